@@ -0,0 +1,108 @@
+import collections
+import mmap
+import struct
+
+# Reader for the capture files written by sump-dump's 'capfile' option, see
+# the comments above struct capfile_header in sump-dump.c
+
+Header = collections.namedtuple('Header', 'version header_bytes samples_offset samples_bytes '
+    'index_offset index_bytes num_samples trigger_sample bytes_per_sample group_enable '
+    'clk_freq_hz clk_divisor num_probes sample_memory trigger_mask trigger_value '
+    'index_interval num_values flags requested_samples '
+    'overview_offset overview_bytes overview_block overview_levels num_stages')
+
+Value = collections.namedtuple('Value', 'name mask num_bits bitmasks')
+Stage = collections.namedtuple('Stage', 'mask value level delay channel serial start')
+
+HEADER_FORMAT = '=8s2I4Q14I2Q4I'
+STAGE_FORMAT = '=6I'
+MAX_STAGES = 4
+VALUE_FORMAT = '=40s2I32I'
+VERSION = 5
+TRUNCATED = 0x1
+STAGE_SERIAL = 0x1
+STAGE_START = 0x2
+
+class Capture:
+    def __init__(self, path):
+        with open(path, 'rb') as f:
+            self.data = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+        fields = struct.unpack_from(HEADER_FORMAT, self.data)
+        assert fields[0].rstrip(b'\0') == b'SUMPCAP', 'not a capture file'
+        assert fields[1] == VERSION, 'unsupported version %d' % fields[1]
+        self.hdr = Header(*fields[1:-1])
+
+        # Trigger stages (trigger_mask and trigger_value are 0 if there are any)
+        self.stages = []
+        stages_at = struct.calcsize(HEADER_FORMAT)
+        for i in range(self.hdr.num_stages):
+            mask, value, level, delay, channel, flags = struct.unpack_from(STAGE_FORMAT, self.data,
+                stages_at + i * struct.calcsize(STAGE_FORMAT))
+            self.stages.append(Stage(mask, value, level, delay, channel,
+                bool(flags & STAGE_SERIAL), bool(flags & STAGE_START)))
+
+        # The vcd value definitions follow the fixed header
+        values_at = stages_at + MAX_STAGES * struct.calcsize(STAGE_FORMAT)
+        self.values = []
+        for i in range(self.hdr.num_values):
+            v = struct.unpack_from(VALUE_FORMAT, self.data, values_at + i * struct.calcsize(VALUE_FORMAT))
+            self.values.append(Value(v[0].rstrip(b'\0').decode(), v[1], v[2], v[3:3 + v[2]]))
+
+        # First entry and number of entries of each overview level
+        self.levels = []
+        at = 0
+        for level in range(self.hdr.overview_levels):
+            block = self.hdr.overview_block << level
+            count = (self.hdr.num_samples + block - 1) // block
+            self.levels.append((at, count))
+            at += count
+
+    def sample(self, i):
+        n = self.hdr.bytes_per_sample
+        at = self.hdr.samples_offset + i * n
+        return int.from_bytes(self.data[at:at + n], 'little')
+
+    def _entry(self, level, j):
+        return struct.unpack_from('=2I', self.data, self.hdr.overview_offset + (self.levels[level][0] + j) * 8)
+
+    def overview(self, first, last, width):
+        """Returns (all_high, any_high) bit masks for each of width columns
+        spanning samples first..last-1: a bit set in all_high was high for the
+        whole column, one clear in any_high low, otherwise it toggled. Reads
+        at most a few entries per column, from the coarsest level whose blocks
+        fit in a column (columns are rounded out to whole blocks), or the
+        samples themselves when zoomed in further than overview_block."""
+        per_column = (last - first) / width
+        level = -1
+        while level + 1 < len(self.levels) and self.hdr.overview_block << (level + 1) <= per_column:
+            level += 1
+        columns = []
+        for c in range(width):
+            a = first + int(c * per_column)
+            b = max(first + int((c + 1) * per_column), a + 1)
+            all_high, any_high = ~0, 0
+            if level < 0:
+                for i in range(a, min(b, self.hdr.num_samples)):
+                    v = self.sample(i)
+                    all_high &= v
+                    any_high |= v
+            else:
+                block = self.hdr.overview_block << level
+                for j in range(a // block, min((b + block - 1) // block, self.levels[level][1])):
+                    ent_all, ent_any = self._entry(level, j)
+                    all_high &= ent_all
+                    any_high |= ent_any
+            columns.append((all_high & ((1 << 8 * self.hdr.bytes_per_sample) - 1), any_high))
+        return columns
+
+if __name__ == '__main__':
+    # Print a text overview of each channel, '-' high, '_' low and '|' toggling
+    import sys
+    cap = Capture(sys.argv[1])
+    width = int(sys.argv[2]) if len(sys.argv) > 2 else 80
+    if not cap.hdr.overview_levels:
+        sys.exit('%s has no overview, write it with capfile overview' % sys.argv[1])
+    columns = cap.overview(0, cap.hdr.num_samples, width)
+    for bit in range(cap.hdr.bytes_per_sample * 8):
+        line = ''.join('-' if a >> bit & 1 else '_' if not o >> bit & 1 else '|' for a, o in columns)
+        print('%2d %s' % (bit, line))
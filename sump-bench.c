@@ -0,0 +1,346 @@
+/*
+Copyright (c) 2017 Thomas Spurden <thomas@spurden.name>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+/* Microbenchmarks for the sump-dump output backends: generates sample buffers
+ * with a given toggle density and group count, and runs each backend on them
+ * to /dev/null, with no device or emulator involved. Built from sump-dump.c
+ * itself so it times exactly the same code.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+/* Count the allocations made by the code under test */
+static atomic_ulong bench_allocs;
+
+static void* bench_malloc(size_t n)
+{
+	atomic_fetch_add(&bench_allocs, 1);
+	return malloc(n);
+}
+
+static void* bench_calloc(size_t n, size_t size)
+{
+	atomic_fetch_add(&bench_allocs, 1);
+	return calloc(n, size);
+}
+
+static void* bench_realloc(void* p, size_t n)
+{
+	atomic_fetch_add(&bench_allocs, 1);
+	return realloc(p, n);
+}
+
+#define malloc bench_malloc
+#define calloc bench_calloc
+#define realloc bench_realloc
+#define main sump_dump_main
+#include "sump-dump.c"
+#undef main
+#undef malloc
+#undef calloc
+#undef realloc
+
+enum backend {
+	BACKEND_HEX,
+	BACKEND_RAW,
+	BACKEND_VCD_1BIT,
+	BACKEND_VCD_BUS,
+	BACKEND_VCD_BITS,
+	BACKEND_CAPFILE,
+	BACKEND_OVERVIEW,
+	BACKEND_COMPRESS,
+	BACKEND_BITPLANES,
+	BACKEND_MEASURE,
+	BACKEND_DECODE_UART,
+	BACKEND_DECODE_SPI,
+	BACKEND_DECODE_I2C,
+	NUM_BACKENDS
+};
+
+static char const* const backend_names[NUM_BACKENDS] = {
+	"hex", "raw", "vcd-1bit", "vcd-bus", "vcd-bits", "capfile", "overview", "compress", "bitplanes", "measure",
+	"uart", "spi", "i2c",
+};
+
+static void bench_argerr(struct args* args, char* msg)
+{
+	fprintf(stderr, "%s: %s\n", msg, args->argv[0]);
+	exit(EXIT_FAILURE);
+}
+
+static void add_vcd_value(struct cfg* cfg, char* spec)
+{
+	struct args args = { .argv = &spec, .argc = 1, .pos = 0, .err = bench_argerr };
+	args_vcd_value(&args, vcd_add_value(cfg), "Invalid VCD value");
+}
+
+static void add_decoder(struct cfg* cfg, enum decode_proto proto, char const* name,
+	uint32_t s0, uint32_t s1, uint32_t s2, uint32_t s3)
+{
+	struct decoder_cfg* dc = &cfg->decode.decoders[cfg->decode.num_decoders++];
+	memset(dc, 0, sizeof(*dc));
+	dc->proto = proto;
+	strcpy(dc->name, name);
+	dc->signals[0] = s0;
+	dc->signals[1] = s1;
+	dc->signals[2] = s2;
+	dc->signals[3] = s3;
+	dc->bits = 8;
+	dc->baud = 1000000;
+}
+
+static void setup_cfg(struct cfg* cfg, enum backend backend, unsigned groups, uint32_t num_samples)
+{
+	memset(cfg, 0, sizeof(*cfg));
+	cfg->num_probes = 32;
+	cfg->max_groups = 4;
+	cfg->group_mask = 0xF;
+	cfg->group_enable = (1u << groups) - 1;
+	cfg->num_groups_enabled = groups;
+	cfg->samples = num_samples;
+	cfg->sample_memory = num_samples * groups;
+	cfg->clk_freq_hz = 100000000;
+	cfg->clk_divisor = 1;
+	cfg->simd = SIMD_AUTO;
+	cfg->threads = 1;
+	cfg->repeat = 1;
+	cfg->verbosity = 0;
+	cfg->output_path = "/dev/null";
+
+	char spec[64];
+	switch(backend) {
+		case BACKEND_RAW:
+			cfg->raw = true;
+			break;
+		case BACKEND_VCD_1BIT:
+			add_vcd_value(cfg, strcpy(spec, "clk=0x1"));
+			break;
+		case BACKEND_VCD_BUS:
+			/* One byte wide value per group */
+			for(unsigned g = 0; g < groups; g += 1) {
+				snprintf(spec, sizeof(spec), "bus%u=0x%X", g, 0xFFu << (g * 8));
+				add_vcd_value(cfg, spec);
+			}
+			break;
+		case BACKEND_VCD_BITS:
+			for(unsigned b = 0; b < groups * 8; b += 1) {
+				snprintf(spec, sizeof(spec), "ch%u=0x%X", b, 1u << b);
+				add_vcd_value(cfg, spec);
+			}
+			break;
+		case BACKEND_OVERVIEW:
+			cfg->overview = true;
+			/* fall through */
+		case BACKEND_CAPFILE:
+			cfg->capfile = true;
+			break;
+		case BACKEND_BITPLANES:
+			cfg->bitplanes = true;
+			/* fall through */
+		case BACKEND_COMPRESS:
+			cfg->compress = true;
+			break;
+		case BACKEND_MEASURE:
+			cfg->measure = true;
+			break;
+		/* The random samples aren't frames, but the decoders still have
+		 * to follow every edge */
+		case BACKEND_DECODE_UART:
+			add_decoder(cfg, DECODE_UART, "uart", 0x1, 0, 0, 0);
+			break;
+		case BACKEND_DECODE_SPI:
+			add_decoder(cfg, DECODE_SPI, "spi", 0x1, 0x2, 0x4, 0x8);
+			break;
+		case BACKEND_DECODE_I2C:
+			add_decoder(cfg, DECODE_I2C, "i2c", 0x1, 0x2, 0, 0);
+			break;
+		case BACKEND_HEX:
+		default:
+			break;
+	}
+}
+
+static uint32_t xorshift32(uint32_t* state)
+{
+	uint32_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*state = x;
+	return x;
+}
+
+/* Samples newest first as the device sends them, where density is the
+ * chance of each sample differing from the one before */
+static uint8_t* generate_samples(unsigned groups, uint32_t num_samples, double density, uint32_t seed)
+{
+	uint8_t* buf = malloc((size_t)num_samples * groups);
+	assert(buf);
+	uint32_t const width = groups == 4? UINT32_MAX : (1u << (groups * 8)) - 1;
+	uint32_t rng = seed;
+	uint32_t v = 0;
+	for(uint32_t i = 0; i < num_samples; i += 1) {
+		if((double)xorshift32(&rng) < density * 4294967296.0) {
+			uint32_t const flip = xorshift32(&rng) & width;
+			v ^= flip? flip : 1;
+		}
+		uint8_t* p = &buf[(size_t)(num_samples - 1 - i) * groups];
+		for(unsigned j = 0; j < groups; j += 1) {
+			p[j] = v >> (j * 8);
+		}
+	}
+	return buf;
+}
+
+struct result {
+	double t; /* Best of the runs */
+	uint64_t bytes;
+	unsigned long allocs;
+};
+
+static struct result run_backend(struct cfg const* cfg, uint8_t* buf, uint32_t num_samples, unsigned reps)
+{
+	struct result res = { .t = 0.0 };
+	for(unsigned r = 0; r < reps; r += 1) {
+		struct readout ro = {
+			.tp = NULL,
+			.buf = buf,
+			.bytes = (size_t)num_samples * cfg->num_groups_enabled,
+			.pos = (size_t)num_samples * cfg->num_groups_enabled,
+		};
+		pthread_mutex_init(&ro.lock, NULL);
+		pthread_cond_init(&ro.cond, NULL);
+		struct output out;
+		output_init(&out, cfg);
+
+		unsigned long const allocs = atomic_load(&bench_allocs);
+		double const t_start = monotonic_time();
+		output_begin(&out, 0);
+		format_samples(&ro, cfg, &out, num_samples);
+		output_end(&out, 0);
+		double const t = monotonic_time() - t_start;
+
+		if(r == 0 || t < res.t) {
+			res.t = t;
+		}
+		res.bytes = out.bytes;
+		res.allocs = atomic_load(&bench_allocs) - allocs;
+		output_close(&out);
+		pthread_cond_destroy(&ro.cond);
+		pthread_mutex_destroy(&ro.lock);
+	}
+	return res;
+}
+
+static void usage(char const* prog)
+{
+	fprintf(stderr, "Usage: %s [<options>]\n\n", prog);
+	fprintf(stderr,
+		"samples <num>: samples per buffer (default = 262140, the most a capture can have).\n"
+		"reps <num>: runs of each case, the fastest is reported (default = 5).\n"
+		"groups <num>: only run with this many groups enabled (default = 1 to 4).\n"
+		"density <fraction>: only run with this toggle density (default = 0.001, 0.05 and 1).\n"
+		"backend <name>: only run this backend (default = all):\n"
+		"	hex raw vcd-1bit vcd-bus vcd-bits capfile overview compress bitplanes measure\n"
+		"	uart spi i2c (protocol decoders)\n"
+		"threads <num>: formatter threads (default = 1).\n");
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char** argv)
+{
+	uint32_t num_samples = UINT16_MAX * 4;
+	uint32_t reps = 5;
+	uint32_t threads = 1;
+	unsigned groups_min = 1, groups_max = 4;
+	double densities[] = { 0.001, 0.05, 1.0 };
+	unsigned num_densities = 3;
+	int only_backend = -1;
+
+	for(int i = 1; i < argc; i += 1) {
+		char const* val = i + 1 < argc? argv[i + 1] : NULL;
+		if(val == NULL) {
+			usage(argv[0]);
+		}
+		if(strcmp(argv[i], "samples") == 0) {
+			num_samples = strtoul(val, NULL, 0) & ~3u;
+		}
+		else if(strcmp(argv[i], "reps") == 0) {
+			reps = strtoul(val, NULL, 0);
+		}
+		else if(strcmp(argv[i], "threads") == 0) {
+			threads = strtoul(val, NULL, 0);
+		}
+		else if(strcmp(argv[i], "groups") == 0) {
+			groups_min = groups_max = strtoul(val, NULL, 0);
+		}
+		else if(strcmp(argv[i], "density") == 0) {
+			densities[0] = strtod(val, NULL);
+			num_densities = 1;
+		}
+		else if(strcmp(argv[i], "backend") == 0) {
+			for(int b = 0; b < NUM_BACKENDS; b += 1) {
+				if(strcmp(val, backend_names[b]) == 0) {
+					only_backend = b;
+				}
+			}
+			if(only_backend == -1) {
+				usage(argv[0]);
+			}
+		}
+		else {
+			usage(argv[0]);
+		}
+		i += 1;
+	}
+	if(num_samples == 0 || reps == 0 || threads == 0 || threads > MAX_FORMAT_THREADS ||
+		groups_min < 1 || groups_max > 4) {
+		usage(argv[0]);
+	}
+
+	printf("%-10s %6s %8s %12s %10s %14s %8s\n", "backend", "groups", "density", "ns/sample", "Msample/s",
+		"bytes/sample", "allocs");
+	for(unsigned groups = groups_min; groups <= groups_max; groups += 1) {
+		for(unsigned d = 0; d < num_densities; d += 1) {
+			uint8_t* buf = generate_samples(groups, num_samples, densities[d], 1);
+			for(int b = 0; b < NUM_BACKENDS; b += 1) {
+				if(only_backend != -1 && b != only_backend) {
+					continue;
+				}
+				struct cfg cfg;
+				setup_cfg(&cfg, b, groups, num_samples);
+				cfg.threads = threads;
+				struct result res = run_backend(&cfg, buf, num_samples, reps);
+				free(cfg.vcd.values);
+				printf("%-10s %6u %8g %12.2f %10.1f %14.2f %8lu\n", backend_names[b], groups, densities[d],
+					res.t * 1e9 / num_samples, num_samples / res.t * 1e-6, (double)res.bytes / num_samples,
+					res.allocs);
+			}
+			free(buf);
+		}
+	}
+	return 0;
+}
@@ -20,9 +20,19 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 SOFTWARE.
  */
 
+#define _GNU_SOURCE
+
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
@@ -34,6 +44,33 @@ SOFTWARE.
 #include <termios.h>
 #include <time.h>
 #include <strings.h>
+#include <pthread.h>
+#include <stdarg.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <linux/serial.h>
+
+/* <asm/termbits.h> clashes with <termios.h> so declare the bits needed for
+ * arbitrary baud rates (TCGETS2/TCSETS2) here */
+#define KERNEL_NCCS 19
+struct termios2 {
+	tcflag_t c_iflag, c_oflag, c_cflag, c_lflag;
+	cc_t c_line;
+	cc_t c_cc[KERNEL_NCCS];
+	speed_t c_ispeed, c_ospeed;
+};
+#ifndef BOTHER
+#define BOTHER 0010000
+#endif
+#ifndef IBSHIFT
+#define IBSHIFT 16
+#endif
+#endif
 
 static void perror_exit(char const* msg)
 {
@@ -41,7 +78,72 @@ static void perror_exit(char const* msg)
 	exit(EXIT_FAILURE);
 }
 
-static void setup_serial(int fd)
+static double monotonic_time(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static struct {
+	uint32_t baud;
+	speed_t speed;
+} const std_bauds[] = {
+	{ 9600, B9600 }, { 19200, B19200 }, { 38400, B38400 }, { 57600, B57600 },
+	{ 115200, B115200 }, { 230400, B230400 },
+#ifdef B460800
+	{ 460800, B460800 }, { 500000, B500000 }, { 576000, B576000 },
+	{ 921600, B921600 }, { 1000000, B1000000 }, { 1152000, B1152000 },
+	{ 1500000, B1500000 }, { 2000000, B2000000 }, { 2500000, B2500000 },
+	{ 3000000, B3000000 }, { 3500000, B3500000 }, { 4000000, B4000000 },
+#endif
+};
+
+/* Set a non-standard baud rate through termios2 (Linux only) */
+static void set_custom_baud(int fd, uint32_t baud)
+{
+#if defined(__linux__) && defined(TCGETS2)
+	struct termios2 tios2;
+	if(ioctl(fd, TCGETS2, &tios2) == -1) {
+		perror_exit("TCGETS2");
+	}
+	tios2.c_cflag &= ~(CBAUD | (CBAUD << IBSHIFT));
+	tios2.c_cflag |= BOTHER | (BOTHER << IBSHIFT);
+	tios2.c_ispeed = baud;
+	tios2.c_ospeed = baud;
+	if(ioctl(fd, TCSETS2, &tios2) == -1) {
+		perror_exit("TCSETS2");
+	}
+	if(ioctl(fd, TCGETS2, &tios2) == -1) {
+		perror_exit("TCGETS2");
+	}
+	if(tios2.c_ospeed != baud) {
+		fprintf(stderr, "Warning: requested %u baud, got %u\n", baud, tios2.c_ospeed);
+	}
+#else
+	fprintf(stderr, "Baud rate %u not supported on this platform\n", baud);
+	exit(EXIT_FAILURE);
+#endif
+}
+
+static void set_low_latency(int fd)
+{
+#if defined(__linux__) && defined(ASYNC_LOW_LATENCY)
+	struct serial_struct ser;
+	if(ioctl(fd, TIOCGSERIAL, &ser) == -1) {
+		fprintf(stderr, "Warning: cannot enable low latency mode: %s\n", strerror(errno));
+		return;
+	}
+	ser.flags |= ASYNC_LOW_LATENCY;
+	if(ioctl(fd, TIOCSSERIAL, &ser) == -1) {
+		fprintf(stderr, "Warning: cannot enable low latency mode: %s\n", strerror(errno));
+	}
+#else
+	fprintf(stderr, "Warning: low latency mode not supported on this platform\n");
+#endif
+}
+
+static void setup_serial(int fd, uint32_t baud, bool rtscts, bool low_latency)
 {
 	struct termios tios;
 	if(tcgetattr(fd, &tios) == -1) {
@@ -51,21 +153,44 @@ static void setup_serial(int fd)
 	tios.c_iflag &= ~(INPCK | ISTRIP | IGNCR | ICRNL | INLCR | IXOFF | IXON);
 	tios.c_oflag &= ~OPOST;
 	tios.c_lflag &= ~(ISIG | ICANON | ECHO);
-	tios.c_cflag &= ~(CSTOPB | PARENB | CSIZE);
+	tios.c_cflag &= ~(CSTOPB | PARENB | CSIZE | CRTSCTS);
 
 	tios.c_iflag |= IGNBRK;
 	tios.c_cflag |= (CS8 | CREAD);
+	if(rtscts) {
+		tios.c_cflag |= CRTSCTS;
+	}
+	tios.c_cc[VMIN] = 1;
+	tios.c_cc[VTIME] = 0;
+
+	/* Non-standard rates are set up at 115200 then switched over after */
+	speed_t speed = B115200;
+	bool std_baud = false;
+	for(unsigned i = 0; i < sizeof(std_bauds) / sizeof(std_bauds[0]); i += 1) {
+		if(std_bauds[i].baud == baud) {
+			speed = std_bauds[i].speed;
+			std_baud = true;
+		}
+	}
 
-	if(cfsetospeed(&tios, B115200) == -1) {
+	if(cfsetospeed(&tios, speed) == -1) {
 		perror_exit("cfsetospeed");
 	}
-	if(cfsetispeed(&tios, B115200) == -1) {
+	if(cfsetispeed(&tios, speed) == -1) {
 		perror_exit("cfsetospeed");
 	}
 
 	if(tcsetattr(fd, TCSANOW, &tios) == -1) {
 		perror_exit("tcsetattr");
 	}
+
+	if(!std_baud) {
+		set_custom_baud(fd, baud);
+	}
+
+	if(low_latency) {
+		set_low_latency(fd);
+	}
 }
 
 struct cmd {
@@ -78,30 +203,156 @@ static struct cmd const cmd_run = { .data = { 1, }, .len = 1 };
 static struct cmd const cmd_id = { .data = { 2, }, .len = 1 };
 static struct cmd const cmd_get_meta = { .data = { 4, }, .len = 1 };
 
-static void write_tty(int fd, struct cmd const* cmd)
+/* Connection to the device: a tty, or a unix/TCP socket to a device model.
+ * Commands are queued and sent in one write when a reply or the capture data
+ * is needed, so a whole configuration costs one syscall. */
+struct transport {
+	int fd;
+	bool trace; /* Log commands to stderr */
+	double timeout; /* For replies, in seconds (0 = wait forever) */
+	uint8_t queue[256];
+	size_t queued;
+};
+
+static int connect_unix(char const* path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	if(strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Socket path too long: %s\n", path);
+		exit(EXIT_FAILURE);
+	}
+	strcpy(addr.sun_path, path);
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(fd == -1) {
+		perror_exit("socket");
+	}
+	if(connect(fd, (struct sockaddr const*)&addr, sizeof(addr)) == -1) {
+		fprintf(stderr, "Error connecting to %s: %s\n", path, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	return fd;
+}
+
+/* host:port */
+static int connect_tcp(char const* hostport)
+{
+	char host[256];
+	char const* colon = strrchr(hostport, ':');
+	if(colon == NULL || (size_t)(colon - hostport) >= sizeof(host)) {
+		fprintf(stderr, "Invalid TCP address (must be host:port): %s\n", hostport);
+		exit(EXIT_FAILURE);
+	}
+	memcpy(host, hostport, colon - hostport);
+	host[colon - hostport] = '\0';
+
+	struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+	struct addrinfo* res;
+	int err = getaddrinfo(host, colon + 1, &hints, &res);
+	if(err != 0) {
+		fprintf(stderr, "Error resolving %s: %s\n", hostport, gai_strerror(err));
+		exit(EXIT_FAILURE);
+	}
+	int fd = -1;
+	for(struct addrinfo* ai = res; ai && fd == -1; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+		if(fd != -1 && connect(fd, ai->ai_addr, ai->ai_addrlen) == -1) {
+			close(fd);
+			fd = -1;
+		}
+	}
+	freeaddrinfo(res);
+	if(fd == -1) {
+		fprintf(stderr, "Error connecting to %s: %s\n", hostport, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	int one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	return fd;
+}
+
+static void transport_open(struct transport* tp, char const* path,
+	uint32_t baud, bool rtscts, bool low_latency)
+{
+	tp->queued = 0;
+	if(strncmp(path, "unix:", 5) == 0) {
+		tp->fd = connect_unix(path + 5);
+	}
+	else if(strncmp(path, "tcp:", 4) == 0) {
+		tp->fd = connect_tcp(path + 4);
+	}
+	else {
+		tp->fd = open(path, O_RDWR | O_NOCTTY);
+		if(tp->fd == -1) {
+			fprintf(stderr, "Error opening %s: %s\n", path, strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		setup_serial(tp->fd, baud, rtscts, low_latency);
+	}
+}
+
+static void transport_flush(struct transport* tp)
 {
-	fprintf(stderr, ">");
-	for(unsigned i = 0; i < cmd->len; i += 1) {
-		fprintf(stderr, " %02X", cmd->data[i]);
+	size_t pos = 0;
+	while(pos < tp->queued) {
+		ssize_t sz = write(tp->fd, &tp->queue[pos], tp->queued - pos);
+		if(sz == -1) {
+			if(errno == EINTR) {
+				continue;
+			}
+			perror_exit("Error writing command to device");
+		}
+		pos += sz;
 	}
-	fprintf(stderr, "\n");
+	tp->queued = 0;
+}
 
-	ssize_t sz = write(fd, cmd->data, cmd->len);
-	if(sz == -1) {
-		perror_exit("Error writing command to tty");
+static void transport_send(struct transport* tp, struct cmd const* cmd)
+{
+	if(tp->trace) {
+		char line[32];
+		int n = sprintf(line, ">");
+		for(unsigned i = 0; i < cmd->len; i += 1) {
+			n += sprintf(&line[n], " %02X", cmd->data[i]);
+		}
+		fprintf(stderr, "%s\n", line);
 	}
-	if(sz != cmd->len) {
-		perror_exit("Could not write whole command to tty");
+
+	if(tp->queued + cmd->len > sizeof(tp->queue)) {
+		transport_flush(tp);
 	}
+	memcpy(&tp->queue[tp->queued], cmd->data, cmd->len);
+	tp->queued += cmd->len;
 }
 
-static void read_tty(int fd, uint8_t* buf, size_t bytes)
+static void transport_read(struct transport* tp, uint8_t* buf, size_t bytes)
 {
+	transport_flush(tp);
 	size_t pos = 0;
 	while(pos < bytes) {
-		ssize_t sz = read(fd, &buf[pos], bytes - pos);
+		if(tp->timeout > 0.0) {
+			struct pollfd pfd = { .fd = tp->fd, .events = POLLIN };
+			int r = poll(&pfd, 1, (int)(tp->timeout * 1e3) + 1);
+			if(r == -1 && errno == EINTR) {
+				continue;
+			}
+			if(r == -1) {
+				perror_exit("poll");
+			}
+			if(r == 0) {
+				fprintf(stderr, "Timed out waiting for reply from device\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+		ssize_t sz = read(tp->fd, &buf[pos], bytes - pos);
 		if(sz == -1) {
-			perror_exit("Error reading from tty");
+			if(errno == EINTR) {
+				continue;
+			}
+			perror_exit("Error reading from device");
+		}
+		if(sz == 0) {
+			fprintf(stderr, "Error reading from device: end of file\n");
+			exit(EXIT_FAILURE);
 		}
 		pos += sz;
 	}
@@ -181,61 +432,163 @@ static void cmd_trig_cfg(struct cmd* cmd, unsigned stage,
 	cmd->data[4] = (channel >> 4) | (serial? 0x4 : 0) | (start? 0x8 : 0);
 }
 
-#define MAX_VCD_VALUES 32
+/* One stage of the device's trigger, see check_trigger_stages() */
+#define MAX_TRIGGER_STAGES 4
+
+struct trigger_stage {
+	uint32_t mask, value;
+	uint16_t delay;
+	unsigned level, channel;
+	bool serial, start;
+};
+
 #define MAX_VCD_VALUE_BITS 32
 #define MAX_VCD_NAME_LEN 32
+#define MAX_FIND_STEPS 8
+#define MAX_DECODERS 4
+#define DECODE_SIGNALS 4
+
+enum decode_proto {
+	DECODE_UART,
+	DECODE_SPI,
+	DECODE_I2C,
+};
+
+enum simd_kernel {
+	SIMD_AUTO,
+	SIMD_SCALAR,
+	SIMD_SSE2,
+	SIMD_AVX2,
+};
 
 struct cfg {
 	uint32_t group_enable;
 	uint32_t trigger_mask, trigger_value;
+	/* Explicit trigger stages, used instead of trigger_mask/value if any */
+	struct trigger_stage stages[MAX_TRIGGER_STAGES];
+	unsigned num_stages;
 	uint32_t clk_divisor;
 	uint32_t samples;
 	uint32_t before_trig;
-	bool rle, raw;
+	bool rle, raw, capfile, overview;
+	bool compress, bitplanes;
+	bool demux;
+	bool measure;
 	bool ext_meta;
+	enum simd_kernel simd;
+	uint32_t threads;
+	bool stats_json;
+
+	/* Readout timeouts in seconds (0 = wait forever): for the first byte, and
+	 * between bytes after that. With salvage what did arrive is written out,
+	 * and truncated_from is set to the requested sample count. */
+	double trigger_timeout, stall_timeout;
+	bool progress, salvage;
+	uint32_t truncated_from;
+
+	unsigned verbosity; /* 0 = warnings only, 1 = progress info, 2 = protocol trace */
+
+	/* Segmented capture: number of segments, whether each one after the first
+	 * triggers on the state the last ended in, and the stitching state while
+	 * writing them (NULL otherwise) */
+	uint32_t segments;
+	bool segment_last;
+	struct segment_state* segment;
+
+	/* Number of captures to take (UINT32_MAX = forever), and where to put them */
+	uint32_t repeat;
+	char const* output_path;
+	uint32_t rotate;
+
+	/* Serial link settings */
+	uint32_t baud;
+	bool rtscts, low_latency;
 
 	/* Device info - either from etended metadata or provided on cmdline */
 	uint32_t clk_freq_hz, sample_memory, num_probes;
 
+	/* Values to write as VCD, grown by vcd_add_value(). Dots in the names
+	 * give the scopes they go in. With channels one value is added per
+	 * enabled channel once the groups are known, see vcd_add_channels(). */
 	struct {
-		uint32_t num_values;
+		uint32_t num_values, alloced;
 		struct vcd_value {
 			char name[MAX_VCD_NAME_LEN+1];
 			uint32_t mask;
 			uint32_t num_bits;
 			uint32_t bitmasks[MAX_VCD_VALUE_BITS];
-		} values[MAX_VCD_VALUES];
+		}* values;
+		bool channels;
 	} vcd;
 
+	/* Pattern search, see find_hits() */
+	struct {
+		uint32_t num_steps;
+		struct find_step {
+			uint32_t mask, value;
+			uint32_t within; /* Samples after the previous step's match */
+		} steps[MAX_FIND_STEPS];
+		bool window; /* Write the samples around each hit rather than a list */
+		uint32_t before, after;
+	} find;
+
+	/* Protocol decoders, see decode_change() */
+	struct {
+		uint32_t num_decoders;
+		struct decoder_cfg {
+			enum decode_proto proto;
+			char name[MAX_VCD_NAME_LEN+1];
+			/* uart: rx, spi: clk mosi miso cs, i2c: scl sda (0 = not used) */
+			uint32_t signals[DECODE_SIGNALS];
+			uint32_t baud, bits, mode;
+			char parity; /* 0, 'e' or 'o' */
+		} decoders[MAX_DECODERS];
+	} decode;
+
 	/* Calculated from other config values */
 	uint32_t max_groups, group_mask;
 	uint32_t num_groups_enabled;
 };
 
-void read_ident(int fd, struct cfg* cfg)
+/* Returns a new zeroed value at the end of the table */
+static struct vcd_value* vcd_add_value(struct cfg* cfg)
+{
+	if(cfg->vcd.num_values == cfg->vcd.alloced) {
+		cfg->vcd.alloced = cfg->vcd.alloced? cfg->vcd.alloced * 2 : 16;
+		cfg->vcd.values = realloc(cfg->vcd.values, cfg->vcd.alloced * sizeof(struct vcd_value));
+		assert(cfg->vcd.values);
+	}
+	struct vcd_value* vv = &cfg->vcd.values[cfg->vcd.num_values++];
+	memset(vv, 0, sizeof(*vv));
+	return vv;
+}
+
+void read_ident(struct transport* tp, struct cfg* cfg)
 {
 
 	for(unsigned i = 0; i < 5; i += 1) {
-		write_tty(fd, &cmd_reset);
+		transport_send(tp, &cmd_reset);
 	}
-	write_tty(fd, &cmd_id);
+	transport_send(tp, &cmd_id);
 	uint8_t ident[4];
-	read_tty(fd, ident, 4);
+	transport_read(tp, ident, 4);
 	if(memcmp(ident, "1ALS", 4) != 0) {
 		fprintf(stderr, "Unknown ident: %c%c%c%c\n", ident[0], ident[1], ident[2], ident[3]);
 		exit(EXIT_FAILURE);
 	}
-	fprintf(stderr, "Sump device found OK\n");
+	if(cfg->verbosity) {
+		fprintf(stderr, "Sump device found OK\n");
+	}
 
 	if(!cfg->ext_meta) {
 		return;
 	}
 
-	write_tty(fd, &cmd_get_meta);
+	transport_send(tp, &cmd_get_meta);
 
 	while(1) {
 		uint8_t meta;
-		read_tty(fd, &meta, 1);
+		transport_read(tp, &meta, 1);
 		if(meta == 0) {
 			/* End of metadata */
 			break;
@@ -245,25 +598,29 @@ void read_ident(int fd, struct cfg* cfg)
 					uint8_t val[256];
 					unsigned i = 0;
 					do {
-						read_tty(fd, &val[i], 1);
+						transport_read(tp, &val[i], 1);
 						i += 1;
 					}
 					while(val[i - 1] != '\0' && i != sizeof(val));
 					if(val[i - 1] != '\0') {
 						fprintf(stderr, "Error: truncating excessively long extended metadata string\n");
 						do {
-							read_tty(fd, &val[sizeof(val) - 1], 1);
+							transport_read(tp, &val[sizeof(val) - 1], 1);
 						}
 						while(val[sizeof(val) - 1] != '\0');
 					}
-					fprintf(stderr, "str[%u] = \"%s\"\n", meta & 0x1f, (char const*)val);
+					if(cfg->verbosity) {
+						fprintf(stderr, "str[%u] = \"%s\"\n", meta & 0x1f, (char const*)val);
+					}
 				}
 				break;
 			case 1: { /* 32-bit uint */
 					uint8_t valb[4];
-					read_tty(fd, valb, 4);
-					uint32_t val = (uint32_t)valb[3] | (valb[2] << 8) | (valb[1] << 16) | (valb[2] << 24);
-					fprintf(stderr, "u32[%u] = 0x%08X\n", meta & 0x1f, val);
+					transport_read(tp, valb, 4);
+					uint32_t val = (uint32_t)valb[3] | (valb[2] << 8) | (valb[1] << 16) | ((uint32_t)valb[0] << 24);
+					if(cfg->verbosity) {
+						fprintf(stderr, "u32[%u] = 0x%08X\n", meta & 0x1f, val);
+					}
 
 					/* Fill in relevant info */
 					switch(meta & 0x1f) {
@@ -276,8 +633,10 @@ void read_ident(int fd, struct cfg* cfg)
 				break;
 			case 2: { /* 8-bit uint */
 					uint8_t val;
-					read_tty(fd, &val, 1);
-					fprintf(stderr, "u8[%u] = 0x%02X\n", meta & 0x1f, val);
+					transport_read(tp, &val, 1);
+					if(cfg->verbosity) {
+						fprintf(stderr, "u8[%u] = 0x%02X\n", meta & 0x1f, val);
+					}
 				}
 				break;
 			default:
@@ -287,225 +646,4187 @@ void read_ident(int fd, struct cfg* cfg)
 	}
 }
 
-static void write_vcd_value(FILE* dest, struct cfg const* cfg, unsigned vali, uint32_t sample)
+/* Growable in-memory output buffer. All sample output is formatted into these
+ * and written out with write() in large blocks, rather than going through
+ * stdio a few bytes at a time. */
+struct outbuf {
+	char* data;
+	size_t len, cap;
+};
+
+static inline char* outbuf_reserve(struct outbuf* ob, size_t n)
 {
-	struct vcd_value const* vv = &cfg->vcd.values[vali];
-	if(vv->num_bits == 1) {
-		fprintf(dest, "%u%c\n", (sample & vv->mask)? 1 : 0, 33 + vali);
-	}
-	else {
-		fprintf(dest, "b");
-		for(unsigned biti = 0; biti < vv->num_bits; biti += 1) {
-			fprintf(dest, "%u", (sample & vv->bitmasks[biti])? 1 : 0);
+	if(ob->len + n > ob->cap) {
+		size_t cap = ob->cap? ob->cap : 65536;
+		while(cap < ob->len + n) {
+			cap *= 2;
+		}
+		ob->data = realloc(ob->data, cap);
+		if(ob->data == NULL) {
+			perror_exit("Error allocating output buffer");
 		}
-		fprintf(dest, " %c\n", 33 + vali);
+		ob->cap = cap;
 	}
+	return &ob->data[ob->len];
 }
 
-static void write_vcd(FILE* dest, struct cfg const* cfg, uint8_t const* sample_buf, uint32_t num_samples)
+static void outbuf_printf(struct outbuf* ob, char const* fmt, ...)
 {
-	char const* const units[] = { "s", "ms", "us", "ns", "ps", "fs" };
-	unsigned const tens[] = { 1, 10, 100 };
+	va_list ap;
+	va_start(ap, fmt);
+	int n = vsnprintf(NULL, 0, fmt, ap);
+	va_end(ap);
+	assert(n >= 0);
 
-	/* capture frequency = (clk freq) / (clk divisor)
-	 * period between samples = 1 / (capture_frequency)
-	 */
-	unsigned ntens = 0;
-	double time_scale = 1.0;
-	double divisor = (double)cfg->clk_divisor;
-	double freq = (double)cfg->clk_freq_hz;
-	while((divisor * time_scale) / freq < 100.0) {
-		time_scale *= 10.0;
-		ntens += 1;
-	}
-	double const period = (divisor * time_scale) / freq;
+	char* p = outbuf_reserve(ob, n + 1);
+	va_start(ap, fmt);
+	vsnprintf(p, n + 1, fmt, ap);
+	va_end(ap);
+	ob->len += n;
+}
 
-	unsigned const unit = ntens / 3;
-	unsigned const unit_scale = tens[ntens % 3];
+static void outbuf_free(struct outbuf* ob)
+{
+	free(ob->data);
+	ob->data = NULL;
+	ob->len = ob->cap = 0;
+}
 
-	assert(unit < 6);
+static void write_all(int fd, void const* data, size_t len)
+{
+	uint8_t const* p = data;
+	while(len > 0) {
+		ssize_t sz = write(fd, p, len);
+		if(sz == -1) {
+			if(errno == EINTR) {
+				continue;
+			}
+			perror_exit("Error writing output");
+		}
+		p += sz;
+		len -= sz;
+	}
+}
 
-	fprintf(stderr, "Captured at %lfHz, period = %lf * %u%s\n", freq / divisor, period, unit_scale, units[unit]);
+static char const digits2[201] =
+	"0001020304050607080910111213141516171819"
+	"2021222324252627282930313233343536373839"
+	"4041424344454647484950515253545556575859"
+	"6061626364656667686970717273747576777879"
+	"8081828384858687888990919293949596979899";
 
-	/* Header */
-	time_t curtime = time(NULL);
-	fprintf(dest, "$date\n  %s$end\n", ctime(&curtime));
-	fprintf(dest, "$version\n   Sump dumper\n$end\n");
-	fprintf(dest, "$timescale %u%s $end\n", unit_scale, units[unit]);
-	for(unsigned vali = 0; vali < cfg->vcd.num_values; vali += 1) {
-		struct vcd_value const* vv = &cfg->vcd.values[vali];
-		fprintf(dest, "$var wire %u %c %s $end\n", vv->num_bits, 33 + vali, vv->name);
+/* Decimal formatting without going through printf, returns end of output
+ * (which needs up to 20 bytes) */
+static inline char* fmt_u64(char* p, uint64_t v)
+{
+	char tmp[20];
+	char* t = &tmp[20];
+	while(v >= 100) {
+		t -= 2;
+		memcpy(t, &digits2[(v % 100) * 2], 2);
+		v /= 100;
 	}
-	fprintf(dest, "$enddefinitions $end\n");
-	fprintf(dest, "$dumpvars\n");
-	for(unsigned vali = 0; vali < cfg->vcd.num_values; vali += 1) {
-		write_vcd_value(dest, cfg, vali, 0);
+	if(v >= 10) {
+		t -= 2;
+		memcpy(t, &digits2[v * 2], 2);
 	}
-	fprintf(dest, "$end\n");
-	/* Samples */
-	uint32_t prev = 0;
-	uint8_t const* ptr = &sample_buf[(num_samples * cfg->num_groups_enabled) - 1];
-	for(unsigned i = 0; i < num_samples; i += 1) {
-		/* Get all groups samples into single 32bit word */
+	else {
+		*--t = '0' + v;
+	}
+	size_t n = &tmp[20] - t;
+	memcpy(p, t, n);
+	return p + n;
+}
+
+/* Get sample i (in chronological order) out of the buffer as read from the
+ * device, which sends the newest sample first with the lowest group first
+ * within each sample */
+static inline uint32_t sample_at(struct cfg const* cfg, uint8_t const* sample_buf, uint32_t num_samples, uint32_t i)
+{
+	uint8_t const* ptr = &sample_buf[(size_t)(num_samples - 1 - i) * cfg->num_groups_enabled];
+	uint32_t cur = 0;
+	for(unsigned j = cfg->num_groups_enabled; j > 0; j -= 1) {
+		cur <<= 8;
+		cur |= ptr[j - 1];
+	}
+	return cur;
+}
+
+/* Sample assembly: turn the newest-first group bytes from the device into a
+ * chronological array of 32-bit samples, and at the same time list the
+ * samples which differ from the one before along with the bits that changed.
+ * Output backends then only need to look at the changes.
+ *
+ * Each kernel handles samples [first, last) given prev (the sample before
+ * first), writing values[first..last) and appending up to (last - first)
+ * changes to chg.
+ */
+struct changes {
+	uint64_t* index;
+	uint32_t* mask;
+	uint32_t* value;
+	uint32_t count;
+};
+
+typedef void (*assemble_fn)(unsigned groups, uint8_t const* sample_buf, uint32_t num_samples,
+	uint32_t first, uint32_t last, uint32_t prev, uint32_t* values, struct changes* chg);
+
+static void assemble_scalar(unsigned groups, uint8_t const* sample_buf, uint32_t num_samples,
+	uint32_t first, uint32_t last, uint32_t prev, uint32_t* values, struct changes* chg)
+{
+	uint32_t n = chg->count;
+	uint8_t const* ptr = &sample_buf[(size_t)(num_samples - first) * groups];
+	for(uint32_t i = first; i < last; i += 1) {
+		ptr -= groups;
 		uint32_t cur = 0;
-		for(unsigned j = 0; j < cfg->num_groups_enabled; j += 1) {
+		for(unsigned j = groups; j > 0; j -= 1) {
 			cur <<= 8;
-			cur |= *(ptr - (cfg->num_groups_enabled - j));
-		}
-		ptr -= cfg->num_groups_enabled;
-
-		/* Write out changed values */
-		uint32_t const changed = prev ^ cur;
-		bool written_time = false;
-		for(unsigned vali = 0; vali < cfg->vcd.num_values; vali += 1) {
-			struct vcd_value const* vv = &cfg->vcd.values[vali];
-			if(i == num_samples - 1 || (changed & vv->mask)) {
-				if(!written_time) {
-					unsigned current_time = (unsigned int)((double)i * period);
-					fprintf(dest, "#%u\n", current_time);
-					written_time = true;
-				}
-				write_vcd_value(dest, cfg, vali, cur);
-			}
+			cur |= ptr[j - 1];
 		}
+		values[i] = cur;
 
+		/* Always written, only kept if something changed */
+		chg->index[n] = i;
+		chg->mask[n] = cur ^ prev;
+		chg->value[n] = cur;
+		n += (cur != prev);
 		prev = cur;
 	}
+	chg->count = n;
 }
 
-static void capture(int fd, struct cfg const* cfg)
+#if defined(__x86_64__) || defined(__i386__)
+/* Compare values[i..i+4) against the samples before them and record changes */
+__attribute__((target("sse2")))
+static inline void changes_sse2(uint32_t const* values, uint32_t i, struct changes* chg)
 {
-	uint32_t group_dis = ~cfg->group_enable & cfg->group_mask;
-
-	/* Reset (5 times as spec-ed */
-	for(unsigned i = 0; i < 5; i += 1) {
-		write_tty(fd, &cmd_reset);
+	__m128i const cur = _mm_loadu_si128((__m128i const*)&values[i]);
+	__m128i const prev = _mm_loadu_si128((__m128i const*)&values[i - 1]);
+	__m128i const diff = _mm_xor_si128(cur, prev);
+	unsigned m = ~_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(diff, _mm_setzero_si128()))) & 0xF;
+	if(m) {
+		uint32_t d[4];
+		_mm_storeu_si128((__m128i*)d, diff);
+		do {
+			unsigned const b = __builtin_ctz(m);
+			chg->index[chg->count] = i + b;
+			chg->mask[chg->count] = d[b];
+			chg->value[chg->count] = values[i + b];
+			chg->count += 1;
+			m &= m - 1;
+		}
+		while(m);
 	}
+}
 
-	struct cmd cmd;
-
-	cmd_divider(&cmd, cfg->clk_divisor - 1);
-	write_tty(fd, &cmd);
-
-	if(cfg->trigger_mask == 0) {
-		cmd_trig_mask(&cmd, 0, 0);
-		write_tty(fd, &cmd);
-
-		cmd_trig_value(&cmd, 0, 0);
-		write_tty(fd, &cmd);
+/* Reverse the order of the 16-bit lanes */
+__attribute__((target("sse2")))
+static inline __m128i reverse_u16_sse2(__m128i v)
+{
+	v = _mm_shufflelo_epi16(v, 0x1B);
+	v = _mm_shufflehi_epi16(v, 0x1B);
+	return _mm_shuffle_epi32(v, 0x4E);
+}
 
-		cmd_trig_cfg(&cmd, 0, 0, 0, 0, false, true);
-		write_tty(fd, &cmd);
+__attribute__((target("sse2")))
+static void assemble_sse2(unsigned groups, uint8_t const* sample_buf, uint32_t num_samples,
+	uint32_t first, uint32_t last, uint32_t prev, uint32_t* values, struct changes* chg)
+{
+	if(first == last || groups == 3) {
+		assemble_scalar(groups, sample_buf, num_samples, first, last, prev, values, chg);
+		return;
 	}
-	else {
-		cmd_trig_mask(&cmd, 0, cfg->trigger_mask);
-		write_tty(fd, &cmd);
-		cmd_trig_value(&cmd, 0, cfg->trigger_value);
-		write_tty(fd, &cmd);
-		cmd_trig_cfg(&cmd, 0, 0, 0, 0, false, true);
-		write_tty(fd, &cmd);
 
-		for(unsigned i = 1; i < 4; i += 1) {
-			cmd_trig_mask(&cmd, i, 0);
-			write_tty(fd, &cmd);
-			cmd_trig_value(&cmd, i, 0);
-			write_tty(fd, &cmd);
-			cmd_trig_cfg(&cmd, i, 0, 3, 0, false, false);
-			write_tty(fd, &cmd);
+	/* The first sample is compared against prev, after that against values[] */
+	assemble_scalar(groups, sample_buf, num_samples, first, first + 1, prev, values, chg);
+	uint32_t i = first + 1;
+	__m128i const zero = _mm_setzero_si128();
+	unsigned const step = 16 / groups;
+
+	while(i + step <= last) {
+		__m128i const v = _mm_loadu_si128((__m128i const*)&sample_buf[(size_t)(num_samples - i - step) * groups]);
+		switch(groups) {
+			case 1: {
+					__m128i r = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+					r = reverse_u16_sse2(r);
+					__m128i const lo = _mm_unpacklo_epi8(r, zero);
+					__m128i const hi = _mm_unpackhi_epi8(r, zero);
+					_mm_storeu_si128((__m128i*)&values[i], _mm_unpacklo_epi16(lo, zero));
+					_mm_storeu_si128((__m128i*)&values[i + 4], _mm_unpackhi_epi16(lo, zero));
+					_mm_storeu_si128((__m128i*)&values[i + 8], _mm_unpacklo_epi16(hi, zero));
+					_mm_storeu_si128((__m128i*)&values[i + 12], _mm_unpackhi_epi16(hi, zero));
+				}
+				break;
+			case 2: {
+					__m128i const r = reverse_u16_sse2(v);
+					_mm_storeu_si128((__m128i*)&values[i], _mm_unpacklo_epi16(r, zero));
+					_mm_storeu_si128((__m128i*)&values[i + 4], _mm_unpackhi_epi16(r, zero));
+				}
+				break;
+			default:
+				_mm_storeu_si128((__m128i*)&values[i], _mm_shuffle_epi32(v, 0x1B));
+				break;
 		}
+		for(unsigned j = 0; j < step; j += 4) {
+			changes_sse2(values, i + j, chg);
+		}
+		i += step;
 	}
 
-	uint32_t max_samples = (cfg->sample_memory / cfg->num_groups_enabled);
-	uint32_t capture_samples = cfg->samples;
-	if(cfg->samples > max_samples) {
-		fprintf(stderr, "Warning: requested more samples than the maximum (%u).\n", max_samples);
-		capture_samples = max_samples;
-	}
-	uint32_t before_samples = cfg->before_trig;
-	if(cfg->before_trig > capture_samples) {
-		fprintf(stderr, "Warning: requested more samples before trigger (%u) than number captured (%u).\n", cfg->before_trig, capture_samples);
-		before_samples = capture_samples;
+	assemble_scalar(groups, sample_buf, num_samples, i, last, values[i - 1], values, chg);
+}
+
+__attribute__((target("avx2")))
+static void assemble_avx2(unsigned groups, uint8_t const* sample_buf, uint32_t num_samples,
+	uint32_t first, uint32_t last, uint32_t prev, uint32_t* values, struct changes* chg)
+{
+	if(first == last) {
+		return;
 	}
-	cmd_counts(&cmd, capture_samples / 4, (capture_samples - before_samples) / 4);
-	write_tty(fd, &cmd);
 
-	cmd_flags(&cmd, group_dis, false, false, false, false, cfg->rle);
-	write_tty(fd, &cmd);
+	assemble_scalar(groups, sample_buf, num_samples, first, first + 1, prev, values, chg);
+	uint32_t i = first + 1;
 
-	write_tty(fd, &cmd_run);
+	__m256i const rev32 = _mm256_setr_epi32(7, 6, 5, 4, 3, 2, 1, 0);
+	__m128i const rev16 = _mm_setr_epi8(14, 15, 12, 13, 10, 11, 8, 9, 6, 7, 4, 5, 2, 3, 0, 1);
+	__m128i const rev8 = _mm_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0, -1, -1, -1, -1, -1, -1, -1, -1);
+	/* 3 groups: move the dwords holding samples 7..4 to the low lane and 3..0
+	 * to the high lane, then pick out each sample's bytes in reverse order */
+	__m256i const perm24 = _mm256_setr_epi32(3, 4, 5, 5, 0, 1, 2, 2);
+	__m256i const shuf24 = _mm256_setr_epi8(
+		9, 10, 11, -1, 6, 7, 8, -1, 3, 4, 5, -1, 0, 1, 2, -1,
+		9, 10, 11, -1, 6, 7, 8, -1, 3, 4, 5, -1, 0, 1, 2, -1);
 
-	uint8_t* buf = malloc(capture_samples * cfg->num_groups_enabled);
-	assert(buf);
-	read_tty(fd, buf, capture_samples * cfg->num_groups_enabled);
+	while(i + 8 <= last) {
+		uint8_t const* src = &sample_buf[(size_t)(num_samples - i - 8) * groups];
+		__m256i cur;
+		switch(groups) {
+			case 1:
+				cur = _mm256_cvtepu8_epi32(_mm_shuffle_epi8(_mm_loadl_epi64((__m128i const*)src), rev8));
+				break;
+			case 2:
+				cur = _mm256_cvtepu16_epi32(_mm_shuffle_epi8(_mm_loadu_si128((__m128i const*)src), rev16));
+				break;
+			case 3: {
+					__m256i const v = _mm256_inserti128_si256(
+						_mm256_castsi128_si256(_mm_loadu_si128((__m128i const*)src)),
+						_mm_loadl_epi64((__m128i const*)&src[16]), 1);
+					cur = _mm256_shuffle_epi8(_mm256_permutevar8x32_epi32(v, perm24), shuf24);
+				}
+				break;
+			default:
+				cur = _mm256_permutevar8x32_epi32(_mm256_loadu_si256((__m256i const*)src), rev32);
+				break;
+		}
+		_mm256_storeu_si256((__m256i*)&values[i], cur);
 
-	if(cfg->vcd.num_values) {
-		write_vcd(stdout, cfg, buf, capture_samples);
+		__m256i const diff = _mm256_xor_si256(cur, _mm256_loadu_si256((__m256i const*)&values[i - 1]));
+		unsigned m = ~_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(diff, _mm256_setzero_si256()))) & 0xFF;
+		if(m) {
+			uint32_t d[8];
+			_mm256_storeu_si256((__m256i*)d, diff);
+			do {
+				unsigned const b = __builtin_ctz(m);
+				chg->index[chg->count] = i + b;
+				chg->mask[chg->count] = d[b];
+				chg->value[chg->count] = values[i + b];
+				chg->count += 1;
+				m &= m - 1;
+			}
+			while(m);
+		}
+		i += 8;
 	}
-	else {
-		uint8_t const* ptr = &buf[(capture_samples * cfg->num_groups_enabled) - 1];
 
-		for(unsigned i = 0; i < capture_samples; i += 1) {
-			if(cfg->raw) {
-				fwrite(ptr - cfg->num_groups_enabled, 1, cfg->num_groups_enabled, stdout);
-				ptr -= cfg->num_groups_enabled;
+	assemble_scalar(groups, sample_buf, num_samples, i, last, values[i - 1], values, chg);
+}
+#endif
+
+static assemble_fn select_assemble_kernel(enum simd_kernel simd)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	if(simd == SIMD_AUTO) {
+		simd = __builtin_cpu_supports("avx2")? SIMD_AVX2
+			: __builtin_cpu_supports("sse2")? SIMD_SSE2 : SIMD_SCALAR;
+	}
+	switch(simd) {
+		case SIMD_AVX2:
+			if(__builtin_cpu_supports("avx2")) {
+				return assemble_avx2;
 			}
-			else {
-				for(unsigned j = 0; j < cfg->num_groups_enabled; j += 1) {
-					printf("%02X", *(ptr - (cfg->num_groups_enabled - j)));
-				}
-				printf("\n");
+			fprintf(stderr, "Warning: AVX2 not supported, using SSE2\n");
+			/* fall through */
+		case SIMD_SSE2:
+			if(__builtin_cpu_supports("sse2")) {
+				return assemble_sse2;
 			}
-			ptr -= cfg->num_groups_enabled;
-		}
+			fprintf(stderr, "Warning: SSE2 not supported, using scalar code\n");
+			/* fall through */
+		default:
+			return assemble_scalar;
 	}
-
-	free(buf);
+#else
+	if(simd == SIMD_SSE2 || simd == SIMD_AVX2) {
+		fprintf(stderr, "Warning: SIMD kernels not supported on this platform, using scalar code\n");
+	}
+	return assemble_scalar;
+#endif
 }
 
-struct args {
-	char** argv;
-	unsigned argc;
-	unsigned pos;
-	void (*err)(struct args*, char*);
-};
+/* Demux mode: channels 0-15 are sampled at twice the rate, each word holding
+ * two samples, the earlier in the low half (groups 0/1) and the later in the
+ * high half (groups 2/3). With the words newest first, swapping the halves of
+ * each word in place gives a newest first stream of half-width samples, which
+ * everything else handles as a normal capture. */
+typedef void (*demux_fn)(uint8_t* buf, size_t words, unsigned half);
 
-static char* args_pop(struct args* args)
+static void demux_scalar(uint8_t* buf, size_t words, unsigned half)
 {
-	if(args->pos == args->argc) {
-		return NULL;
+	if(half == 2) {
+		for(size_t w = 0; w < words; w += 1) {
+			uint32_t v;
+			memcpy(&v, &buf[w * 4], 4);
+			v = (v >> 16) | (v << 16);
+			memcpy(&buf[w * 4], &v, 4);
+		}
 	}
 	else {
-		return args->argv[args->pos++];
+		for(size_t w = 0; w < words; w += 1) {
+			uint8_t const t = buf[w * 2];
+			buf[w * 2] = buf[w * 2 + 1];
+			buf[w * 2 + 1] = t;
+		}
 	}
 }
 
-static void args_number(struct args* args, uint32_t* num, char* msg)
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+static void demux_sse2(uint8_t* buf, size_t words, unsigned half)
 {
-	char* arg = args_pop(args);
-	if(arg == NULL) {
-		args->err(args, msg);
-	}
-	char* end;
-	unsigned long long n = strtoull(arg, &end, 0);
-	if(end == arg || end[0] != '\0' || n > UINT32_MAX) {
-		args->err(args, msg);
+	size_t const bytes = words * half * 2;
+	size_t i = 0;
+	for(; i + 16 <= bytes; i += 16) {
+		__m128i v = _mm_loadu_si128((__m128i const*)&buf[i]);
+		if(half == 2) {
+			v = _mm_shufflelo_epi16(v, 0xB1);
+			v = _mm_shufflehi_epi16(v, 0xB1);
+		}
+		else {
+			v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+		}
+		_mm_storeu_si128((__m128i*)&buf[i], v);
 	}
-
-	*num = (uint32_t)n;
+	demux_scalar(&buf[i], (bytes - i) / (half * 2), half);
 }
+#endif
 
-static void args_si_unit(struct args* args, uint32_t* num, char const* unit, char* msg)
+static demux_fn select_demux_kernel(enum simd_kernel simd)
 {
-	char* arg = args_pop(args);
-	if(arg == NULL) {
-		args->err(args, msg);
-	}
-	char* end;
-	unsigned long long n = strtoull(arg, &end, 0);
-	if(end == arg || n > UINT32_MAX) {
-		args->err(args, msg);
+#if defined(__x86_64__) || defined(__i386__)
+	if(simd != SIMD_SCALAR && __builtin_cpu_supports("sse2")) {
+		return demux_sse2;
 	}
-	switch(end[0]) {
+#endif
+	(void)simd;
+	return demux_scalar;
+}
+
+struct vcd_timescale {
+	double period;
+	unsigned unit_scale;
+	char const* unit;
+};
+
+/* Everything needed to write values, precomputed from the cfg */
+struct vcd_writer {
+	struct vcd_timescale ts;
+	struct cfg const* cfg;
+	uint64_t sample_offset; /* Added to sample numbers for the timestamps */
+	bool use_pext;
+	struct vcd_writer_value {
+		uint32_t mask;
+		uint32_t num_bits;
+		/* Value bits contributed by each byte of the sample */
+		uint32_t byte_bits[4][256];
+		/* Runs of descending sample bits, each one a PEXT */
+		unsigned num_runs;
+		uint32_t run_masks[MAX_VCD_VALUE_BITS];
+		uint8_t run_bits[MAX_VCD_VALUE_BITS];
+		char id[4];
+		unsigned id_len;
+	}* values;
+	/* Bit sets of the values each byte of a change mask touches, indexed by
+	 * [byte][byte value][word], so only those values are looked at */
+	uint32_t num_words;
+	uint64_t* touch;
+};
+
+/* Bits of each byte value as ASCII, msb first */
+static char bin8[256][8];
+
+static void vcd_timescale(struct cfg const* cfg, struct vcd_timescale* ts)
+{
+	char const* const units[] = { "s", "ms", "us", "ns", "ps", "fs" };
+	unsigned const tens[] = { 1, 10, 100 };
+
+	/* capture frequency = (clk freq) / (clk divisor)
+	 * period between samples = 1 / (capture_frequency)
+	 */
+	unsigned ntens = 0;
+	double time_scale = 1.0;
+	double divisor = (double)cfg->clk_divisor;
+	double freq = (double)cfg->clk_freq_hz;
+	while((divisor * time_scale) / freq < 100.0) {
+		time_scale *= 10.0;
+		ntens += 1;
+	}
+	ts->period = (divisor * time_scale) / freq;
+
+	unsigned const unit = ntens / 3;
+	ts->unit_scale = tens[ntens % 3];
+
+	assert(unit < 6);
+	ts->unit = units[unit];
+
+	if(cfg->verbosity) {
+		fprintf(stderr, "Captured at %lfHz, period = %lf * %u%s\n", freq / divisor, ts->period, ts->unit_scale, ts->unit);
+	}
+}
+
+/* Identifier codes are printable characters, more than one once they run out */
+static unsigned vcd_id(char* id, unsigned n)
+{
+	unsigned len = 0;
+	do {
+		id[len] = 33 + n % 94;
+		len += 1;
+		n /= 94;
+	}
+	while(n && len < 4);
+	return len;
+}
+
+/* Identifiers are allocated from id_base, so writers for several devices can
+ * share one file */
+static void vcd_writer_init(struct vcd_writer* vw, struct cfg const* cfg, unsigned id_base)
+{
+	vcd_timescale(cfg, &vw->ts);
+	vw->cfg = cfg;
+	vw->sample_offset = 0;
+#if defined(__x86_64__) || defined(__i386__)
+	vw->use_pext = __builtin_cpu_supports("bmi2");
+#else
+	vw->use_pext = false;
+#endif
+
+	for(unsigned b = 0; b < 256; b += 1) {
+		for(unsigned i = 0; i < 8; i += 1) {
+			bin8[b][i] = (b & (0x80 >> i))? '1' : '0';
+		}
+	}
+
+	vw->values = malloc((cfg->vcd.num_values + 1) * sizeof(struct vcd_writer_value));
+	vw->num_words = (cfg->vcd.num_values + 63) / 64;
+	vw->touch = calloc((size_t)4 * 256 * vw->num_words + 1, sizeof(uint64_t));
+	assert(vw->values && vw->touch);
+
+	for(unsigned vali = 0; vali < cfg->vcd.num_values; vali += 1) {
+		struct vcd_value const* vv = &cfg->vcd.values[vali];
+		struct vcd_writer_value* wv = &vw->values[vali];
+		for(unsigned byte = 0; byte < 4; byte += 1) {
+			for(unsigned v = 0; v < 256; v += 1) {
+				if((v << (byte * 8)) & vv->mask) {
+					vw->touch[((size_t)byte * 256 + v) * vw->num_words + vali / 64] |= 1ull << (vali % 64);
+				}
+			}
+		}
+		wv->mask = vv->mask;
+		wv->num_bits = vv->num_bits;
+		wv->id_len = vcd_id(wv->id, id_base + vali);
+
+		memset(wv->byte_bits, 0, sizeof(wv->byte_bits));
+		wv->num_runs = 0;
+		for(unsigned biti = 0; biti < vv->num_bits; biti += 1) {
+			uint32_t const bm = vv->bitmasks[biti];
+			uint32_t const valbit = 1u << (vv->num_bits - 1 - biti);
+			for(unsigned byte = 0; byte < 4; byte += 1) {
+				uint32_t const bb = (bm >> (byte * 8)) & 0xFF;
+				if(bb) {
+					for(unsigned v = 0; v < 256; v += 1) {
+						if(v & bb) {
+							wv->byte_bits[byte][v] |= valbit;
+						}
+					}
+				}
+			}
+
+			/* PEXT keeps bit order, so each run of descending bits is one */
+			if(biti > 0 && bm < vv->bitmasks[biti - 1]) {
+				wv->run_masks[wv->num_runs - 1] |= bm;
+				wv->run_bits[wv->num_runs - 1] += 1;
+			}
+			else {
+				wv->run_masks[wv->num_runs] = bm;
+				wv->run_bits[wv->num_runs] = 1;
+				wv->num_runs += 1;
+			}
+		}
+	}
+}
+
+static void vcd_writer_free(struct vcd_writer* vw)
+{
+	free(vw->values);
+	free(vw->touch);
+}
+
+/* Word w of the set of values with bits in changed */
+static inline uint64_t vcd_touched(struct vcd_writer const* vw, uint32_t w, uint32_t changed)
+{
+	uint64_t const* t = &vw->touch[w];
+	size_t const stride = vw->num_words;
+	return t[(changed & 0xFF) * stride]
+		| t[(256 + ((changed >> 8) & 0xFF)) * stride]
+		| t[(512 + ((changed >> 16) & 0xFF)) * stride]
+		| t[(768 + (changed >> 24)) * stride];
+}
+
+/* Word w of the set of all values */
+static inline uint64_t vcd_all_values(struct vcd_writer const* vw, uint32_t w)
+{
+	uint32_t const n = vw->cfg->vcd.num_values - w * 64;
+	return n >= 64? ~0ull : (1ull << n) - 1;
+}
+
+static inline uint32_t vcd_extract_table(struct vcd_writer_value const* wv, uint32_t sample)
+{
+	return wv->byte_bits[0][sample & 0xFF]
+		| wv->byte_bits[1][(sample >> 8) & 0xFF]
+		| wv->byte_bits[2][(sample >> 16) & 0xFF]
+		| wv->byte_bits[3][sample >> 24];
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("bmi2")))
+static inline uint32_t vcd_extract_pext(struct vcd_writer_value const* wv, uint32_t sample)
+{
+	uint64_t v = 0;
+	for(unsigned r = 0; r < wv->num_runs; r += 1) {
+		v = (v << wv->run_bits[r]) | _pext_u32(sample, wv->run_masks[r]);
+	}
+	return (uint32_t)v;
+}
+#endif
+
+static inline __attribute__((always_inline)) char* write_vcd_value(char* p,
+	struct vcd_writer_value const* wv, uint32_t sample, bool use_pext)
+{
+	if(wv->num_bits == 1) {
+		*p++ = (sample & wv->mask)? '1' : '0';
+	}
+	else {
+		uint32_t v;
+#if defined(__x86_64__) || defined(__i386__)
+		if(use_pext) {
+			v = vcd_extract_pext(wv, sample);
+		}
+		else
+#endif
+		{
+			v = vcd_extract_table(wv, sample);
+		}
+		*p++ = 'b';
+		unsigned n = wv->num_bits;
+		unsigned const r = n % 8;
+		if(r) {
+			n -= r;
+			memcpy(p, &bin8[(v >> n) & ((1u << r) - 1)][8 - r], r);
+			p += r;
+		}
+		while(n) {
+			n -= 8;
+			memcpy(p, bin8[(v >> n) & 0xFF], 8);
+			p += 8;
+		}
+		*p++ = ' ';
+	}
+	memcpy(p, wv->id, 4);
+	p += wv->id_len;
+	*p++ = '\n';
+	return p;
+}
+
+/* Worst case bytes written by write_vcd_value */
+#define VCD_VALUE_MAX_LEN (1 + MAX_VCD_VALUE_BITS + 1 + 4 + 1 + 8)
+
+/* Dot separated components of s[from, to) */
+static unsigned vcd_scope_depth(char const* s, unsigned from, unsigned to)
+{
+	unsigned n = to > from? 1 : 0;
+	for(unsigned i = from; i < to; i += 1) {
+		n += s[i] == '.';
+	}
+	return n;
+}
+
+/* Orders names by their scope (the part before the last dot), with each
+ * scope's nested scopes straight after it, by treating the end of the scope as
+ * less than a dot and a dot as less than any other character */
+static int vcd_scope_cmp(char const* a, char const* b)
+{
+	char const* const a_dot = strrchr(a, '.');
+	char const* const b_dot = strrchr(b, '.');
+	size_t const a_len = a_dot? (size_t)(a_dot - a) : 0;
+	size_t const b_len = b_dot? (size_t)(b_dot - b) : 0;
+	for(size_t i = 0; ; i += 1) {
+		int const ca = i == a_len? 0 : a[i] == '.'? 1 : (unsigned char)a[i] + 2;
+		int const cb = i == b_len? 0 : b[i] == '.'? 1 : (unsigned char)b[i] + 2;
+		if(ca != cb || ca == 0) {
+			return ca - cb;
+		}
+	}
+}
+
+/* $var lines for the values, a name like a.b.c going in scope b inside scope
+ * a. The values are written grouped by scope (otherwise in the order given)
+ * so that each scope is opened once. */
+static void write_vcd_vars(struct outbuf* ob, struct vcd_writer const* vw)
+{
+	struct cfg const* cfg = vw->cfg;
+	unsigned const num_values = cfg->vcd.num_values;
+
+	/* Stable insertion sort, headers are written once per capture */
+	unsigned* order = malloc((num_values + 1) * sizeof(unsigned));
+	assert(order);
+	for(unsigned k = 0; k < num_values; k += 1) {
+		unsigned j = k;
+		while(j > 0 && vcd_scope_cmp(cfg->vcd.values[order[j - 1]].name, cfg->vcd.values[k].name) > 0) {
+			order[j] = order[j - 1];
+			j -= 1;
+		}
+		order[j] = k;
+	}
+
+	char const* scope = "";
+	unsigned scope_len = 0;
+	for(unsigned k = 0; k <= num_values; k += 1) {
+		/* One past the end to close everything */
+		unsigned const vali = k < num_values? order[k] : num_values;
+		char const* const name = vali < num_values? cfg->vcd.values[vali].name : "";
+		char const* const dot = strrchr(name, '.');
+		unsigned const len = dot? dot - name : 0;
+
+		/* Length of the whole components the scopes have in common */
+		unsigned common = 0;
+		for(unsigned i = 0; i <= len && i <= scope_len; i += 1) {
+			bool const end_new = i == len || name[i] == '.';
+			bool const end_cur = i == scope_len || scope[i] == '.';
+			if(end_new && end_cur) {
+				common = i;
+				if(i < len && i < scope_len) {
+					continue;
+				}
+			}
+			if(end_new || end_cur || name[i] != scope[i]) {
+				break;
+			}
+		}
+		unsigned const skip = common? common + 1 : 0;
+		for(unsigned n = vcd_scope_depth(scope, skip, scope_len); n > 0; n -= 1) {
+			outbuf_printf(ob, "$upscope $end\n");
+		}
+		for(unsigned i = skip; i < len; ) {
+			unsigned j = i;
+			while(j < len && name[j] != '.') {
+				j += 1;
+			}
+			outbuf_printf(ob, "$scope module %.*s $end\n", j - i, &name[i]);
+			i = j + 1;
+		}
+		scope = name;
+		scope_len = len;
+
+		if(vali < num_values) {
+			struct vcd_writer_value const* wv = &vw->values[vali];
+			outbuf_printf(ob, "$var wire %u %.*s %s $end\n", wv->num_bits, wv->id_len, wv->id,
+				dot? dot + 1 : name);
+		}
+	}
+	free(order);
+}
+
+static void write_vcd_header(struct outbuf* ob, struct vcd_writer const* vw)
+{
+	struct cfg const* cfg = vw->cfg;
+	time_t curtime = time(NULL);
+	outbuf_printf(ob, "$date\n  %s$end\n", ctime(&curtime));
+	outbuf_printf(ob, "$version\n   Sump dumper\n$end\n");
+	outbuf_printf(ob, "$timescale %u%s $end\n", vw->ts.unit_scale, vw->ts.unit);
+	if(cfg->truncated_from) {
+		outbuf_printf(ob, "$comment\n   Truncated capture: %u of %u samples received\n$end\n",
+			cfg->samples, cfg->truncated_from);
+	}
+	write_vcd_vars(ob, vw);
+	/* Decoded frames, see write_decoded_vcd() */
+	for(unsigned d = 0; d < cfg->decode.num_decoders; d += 1) {
+		char id[4];
+		unsigned const id_len = vcd_id(id, cfg->vcd.num_values + d);
+		outbuf_printf(ob, "$var string 1 %.*s %s $end\n", id_len, id, cfg->decode.decoders[d].name);
+	}
+	outbuf_printf(ob, "$enddefinitions $end\n");
+	outbuf_printf(ob, "$dumpvars\n");
+	for(unsigned vali = 0; vali < cfg->vcd.num_values; vali += 1) {
+		char* p = outbuf_reserve(ob, VCD_VALUE_MAX_LEN);
+		ob->len += write_vcd_value(p, &vw->values[vali], 0, false) - p;
+	}
+	outbuf_printf(ob, "$end\n");
+}
+
+/* Up to this many values write_vcd_changes_body tests each value's mask
+ * instead of going through the per-byte touch table */
+#define VCD_SCAN_VALUES 8
+
+static inline __attribute__((always_inline)) char* write_vcd_change(char* p, struct vcd_writer const* vw,
+	struct vcd_writer_value const* wv, uint64_t i, uint32_t cur, bool* written_time, bool use_pext)
+{
+	if(!*written_time) {
+		*p++ = '#';
+		p = fmt_u64(p, (uint64_t)((double)(i + vw->sample_offset) * vw->ts.period));
+		*p++ = '\n';
+		*written_time = true;
+	}
+	return write_vcd_value(p, wv, cur, use_pext);
+}
+
+static inline __attribute__((always_inline)) void write_vcd_changes_body(struct outbuf* ob,
+	struct vcd_writer const* vw, uint64_t num_samples, struct changes const* chg, bool use_pext)
+{
+	struct cfg const* cfg = vw->cfg;
+	unsigned const num_values = cfg->vcd.num_values;
+	size_t const max_len = 22 + num_values * VCD_VALUE_MAX_LEN;
+
+	for(uint32_t c = 0; c < chg->count; c += 1) {
+		uint64_t const i = chg->index[c];
+		uint32_t const changed = chg->mask[c];
+		uint32_t const cur = chg->value[c];
+
+		/* Write out changed values (all of them for the final sample) */
+		char* const start = outbuf_reserve(ob, max_len);
+		char* p = start;
+		bool written_time = false;
+		if(num_values <= VCD_SCAN_VALUES) {
+			/* Few enough values that checking each mask beats the lookup */
+			for(unsigned v = 0; v < num_values; v += 1) {
+				struct vcd_writer_value const* wv = &vw->values[v];
+				if(i == num_samples - 1 || (changed & wv->mask)) {
+					p = write_vcd_change(p, vw, wv, i, cur, &written_time, use_pext);
+				}
+			}
+		}
+		else {
+			for(uint32_t w = 0; w < vw->num_words; w += 1) {
+				uint64_t vals = i == num_samples - 1? vcd_all_values(vw, w) : vcd_touched(vw, w, changed);
+				while(vals) {
+					struct vcd_writer_value const* wv = &vw->values[w * 64 + __builtin_ctzll(vals)];
+					vals &= vals - 1;
+					p = write_vcd_change(p, vw, wv, i, cur, &written_time, use_pext);
+				}
+			}
+		}
+		ob->len += p - start;
+	}
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("bmi2")))
+static void write_vcd_changes_pext(struct outbuf* ob, struct vcd_writer const* vw,
+	uint64_t num_samples, struct changes const* chg)
+{
+	write_vcd_changes_body(ob, vw, num_samples, chg, true);
+}
+#endif
+
+/* Write value changes given where the samples change. The change list must
+ * include the final sample of the capture. */
+static void write_vcd_changes(struct outbuf* ob, struct vcd_writer const* vw,
+	uint64_t num_samples, struct changes const* chg)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	if(vw->use_pext) {
+		write_vcd_changes_pext(ob, vw, num_samples, chg);
+		return;
+	}
+#endif
+	write_vcd_changes_body(ob, vw, num_samples, chg, false);
+}
+
+/* Hex lines only need formatting where the sample changes, in between the
+ * previous line is repeated. cur is the sample value before first, and chg
+ * the changes in [first, last). */
+static void write_hex_changes(struct outbuf* ob, struct cfg const* cfg,
+	uint64_t first, uint64_t last, uint32_t cur, struct changes const* chg)
+{
+	static char const hex[] = "0123456789ABCDEF";
+	unsigned const line_len = cfg->num_groups_enabled * 2 + 1;
+	char line[9];
+	char* p = outbuf_reserve(ob, (size_t)(last - first) * line_len);
+	uint32_t c = 0;
+	for(uint64_t i = first; i < last; i += 1) {
+		if(i == first || (c < chg->count && chg->index[c] == i)) {
+			if(c < chg->count && chg->index[c] == i) {
+				cur = chg->value[c];
+				c += 1;
+			}
+			for(unsigned j = 0; j < line_len - 1; j += 1) {
+				line[j] = hex[(cur >> ((line_len - 2 - j) * 4)) & 0xF];
+			}
+			line[line_len - 1] = '\n';
+		}
+		memcpy(p, line, line_len);
+		p += line_len;
+	}
+	ob->len = p - ob->data;
+}
+
+static void write_raw_samples(struct outbuf* ob, struct cfg const* cfg,
+	uint8_t const* sample_buf, uint32_t num_samples, uint32_t first, uint32_t last)
+{
+	unsigned const groups = cfg->num_groups_enabled;
+	char* p = outbuf_reserve(ob, (size_t)(last - first) * groups);
+	for(uint32_t i = first; i < last; i += 1) {
+		memcpy(p, &sample_buf[(size_t)(num_samples - 1 - i) * groups], groups);
+		p += groups;
+	}
+	ob->len = p - ob->data;
+}
+
+/* Capture file: a fixed header with everything needed to interpret the
+ * samples followed by num_values VCD value definitions (header_bytes covers
+ * both), then the samples in chronological order (bytes_per_sample each, as
+ * in raw output), then an index entry for every index_interval samples, then
+ * optionally the overview pyramid. Each section starts on a page boundary so
+ * they can be mmap-ed directly. All fields are in host byte order, readers
+ * can check with the version field.
+ */
+#define CAPFILE_VERSION 5
+#define CAPFILE_TRUNCATED 0x1
+#define CAPFILE_STAGE_SERIAL 0x1
+#define CAPFILE_STAGE_START 0x2
+#define CAPFILE_ALIGN 4096
+#define CAPFILE_INDEX_INTERVAL 4096
+#define CAPFILE_OVERVIEW_BLOCK 64 /* Must divide CAPFILE_INDEX_INTERVAL */
+
+
+struct capfile_header {
+	char magic[8]; /* "SUMPCAP" */
+	uint32_t version;
+	uint32_t header_bytes;
+	uint64_t samples_offset, samples_bytes;
+	uint64_t index_offset, index_bytes;
+	uint32_t num_samples, trigger_sample;
+	uint32_t bytes_per_sample, group_enable;
+	uint32_t clk_freq_hz, clk_divisor;
+	uint32_t num_probes, sample_memory;
+	uint32_t trigger_mask, trigger_value; /* Both 0 with stages */
+	uint32_t index_interval, num_values;
+	uint32_t flags; /* CAPFILE_TRUNCATED: timed out, only the last num_samples arrived */
+	uint32_t requested_samples;
+	uint64_t overview_offset, overview_bytes; /* Both 0 without an overview */
+	uint32_t overview_block, overview_levels;
+	uint32_t num_stages, reserved; /* Multi-stage trigger, as given with 'stage' */
+	struct capfile_stage {
+		uint32_t mask, value;
+		uint32_t level, delay, channel;
+		uint32_t flags; /* CAPFILE_STAGE_SERIAL, CAPFILE_STAGE_START */
+	} stages[MAX_TRIGGER_STAGES];
+};
+
+struct capfile_value {
+	char name[40];
+	uint32_t mask, num_bits;
+	uint32_t bitmasks[MAX_VCD_VALUE_BITS];
+};
+
+/* Transitions are samples which differ from the one before. With the
+ * cumulative count a reader can binary search for the n-th transition, and
+ * skip blocks where the channels it wants don't change. */
+struct capfile_index {
+	uint64_t transitions; /* Before the start of the block */
+	uint32_t value; /* First sample of the block */
+	uint32_t toggled; /* Bits changing in the block, including into its first sample */
+};
+
+/* Overview pyramid, for drawing or searching a long capture zoomed out
+ * without reading every sample. Level 0 has an entry for each overview_block
+ * samples, and each level above it one entry for every two below, the last
+ * one of a level covering what is left. Level n so has
+ * ceil(num_samples / (overview_block << n)) entries, and the top level a
+ * single one for the whole capture. The levels are stored one after the other
+ * from level 0. A bit set in all_high is high throughout the block, one clear
+ * in any_high low throughout; otherwise the channel toggles in it. */
+struct capfile_overview {
+	uint32_t all_high; /* AND of the samples */
+	uint32_t any_high; /* OR of the samples */
+};
+
+static inline uint64_t capfile_align(uint64_t offset)
+{
+	return (offset + CAPFILE_ALIGN - 1) & ~(uint64_t)(CAPFILE_ALIGN - 1);
+}
+
+static inline uint64_t capfile_index_bytes(uint32_t num_samples)
+{
+	uint32_t const num_index = (num_samples + CAPFILE_INDEX_INTERVAL - 1) / CAPFILE_INDEX_INTERVAL;
+	return (uint64_t)num_index * sizeof(struct capfile_index);
+}
+
+static unsigned capfile_overview_levels(uint32_t num_samples)
+{
+	unsigned levels = 0;
+	for(uint64_t block = CAPFILE_OVERVIEW_BLOCK; num_samples > 0; block *= 2) {
+		levels += 1;
+		if(block >= num_samples) {
+			break;
+		}
+	}
+	return levels;
+}
+
+static uint64_t capfile_overview_entries(uint32_t num_samples)
+{
+	uint64_t entries = 0;
+	unsigned const levels = capfile_overview_levels(num_samples);
+	for(unsigned level = 0; level < levels; level += 1) {
+		uint64_t const block = (uint64_t)CAPFILE_OVERVIEW_BLOCK << level;
+		entries += (num_samples + block - 1) / block;
+	}
+	return entries;
+}
+
+static inline uint64_t capfile_header_bytes(struct cfg const* cfg)
+{
+	return sizeof(struct capfile_header) + (uint64_t)cfg->vcd.num_values * sizeof(struct capfile_value);
+}
+
+/* Size of the whole file, for writing it in place */
+static uint64_t capfile_bytes(struct cfg const* cfg, uint32_t num_samples)
+{
+	uint64_t const index_offset = capfile_align(capfile_align(capfile_header_bytes(cfg)) +
+		(uint64_t)num_samples * cfg->num_groups_enabled);
+	uint64_t const index_end = index_offset + capfile_index_bytes(num_samples);
+	if(!cfg->overview) {
+		return index_end;
+	}
+	return capfile_align(index_end) + capfile_overview_entries(num_samples) * sizeof(struct capfile_overview);
+}
+
+static void write_capfile_header(struct outbuf* ob, struct cfg const* cfg, uint32_t num_samples)
+{
+	struct capfile_header hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, "SUMPCAP", 8);
+	hdr.version = CAPFILE_VERSION;
+	hdr.header_bytes = capfile_header_bytes(cfg);
+	hdr.samples_offset = capfile_align(hdr.header_bytes);
+	hdr.samples_bytes = (uint64_t)num_samples * cfg->num_groups_enabled;
+	hdr.index_offset = capfile_align(hdr.samples_offset + hdr.samples_bytes);
+	hdr.index_bytes = capfile_index_bytes(num_samples);
+	hdr.num_samples = num_samples;
+	hdr.trigger_sample = cfg->before_trig;
+	hdr.bytes_per_sample = cfg->num_groups_enabled;
+	hdr.group_enable = cfg->group_enable & cfg->group_mask;
+	hdr.clk_freq_hz = cfg->clk_freq_hz;
+	hdr.clk_divisor = cfg->clk_divisor;
+	hdr.num_probes = cfg->num_probes;
+	hdr.sample_memory = cfg->sample_memory;
+	hdr.trigger_mask = cfg->trigger_mask;
+	hdr.trigger_value = cfg->trigger_value;
+	hdr.num_stages = cfg->num_stages;
+	for(unsigned st = 0; st < cfg->num_stages; st += 1) {
+		struct trigger_stage const* ts = &cfg->stages[st];
+		hdr.stages[st] = (struct capfile_stage){
+			.mask = ts->mask,
+			.value = ts->value,
+			.level = ts->level,
+			.delay = ts->delay,
+			.channel = ts->channel,
+			.flags = (ts->serial? CAPFILE_STAGE_SERIAL : 0) | (ts->start? CAPFILE_STAGE_START : 0),
+		};
+	}
+	hdr.index_interval = CAPFILE_INDEX_INTERVAL;
+	hdr.num_values = cfg->vcd.num_values;
+	hdr.flags = cfg->truncated_from? CAPFILE_TRUNCATED : 0;
+	hdr.requested_samples = cfg->truncated_from? cfg->truncated_from : num_samples;
+	if(cfg->overview) {
+		hdr.overview_offset = capfile_align(hdr.index_offset + hdr.index_bytes);
+		hdr.overview_bytes = capfile_overview_entries(num_samples) * sizeof(struct capfile_overview);
+		hdr.overview_block = CAPFILE_OVERVIEW_BLOCK;
+		hdr.overview_levels = capfile_overview_levels(num_samples);
+	}
+
+	char* p = outbuf_reserve(ob, hdr.samples_offset);
+	memset(p, 0, hdr.samples_offset);
+	memcpy(p, &hdr, sizeof(hdr));
+	for(unsigned vali = 0; vali < hdr.num_values; vali += 1) {
+		struct vcd_value const* vv = &cfg->vcd.values[vali];
+		struct capfile_value cv;
+		memset(&cv, 0, sizeof(cv));
+		memcpy(cv.name, vv->name, sizeof(vv->name));
+		cv.mask = vv->mask;
+		cv.num_bits = vv->num_bits;
+		memcpy(cv.bitmasks, vv->bitmasks, sizeof(vv->bitmasks));
+		memcpy(&p[sizeof(hdr) + vali * sizeof(cv)], &cv, sizeof(cv));
+	}
+	ob->len += hdr.samples_offset;
+}
+
+/* Builds the index and overview entries in place from the sample values,
+ * an index block at a time. The sections can be at any alignment in memory
+ * (the output file may be mapped from any offset), so entries are copied. */
+struct capfile_summary {
+	uint8_t* index;
+	uint8_t* overview; /* NULL without an overview */
+	uint64_t transitions;
+	uint32_t prev;
+};
+
+/* values[0] is sample first, which starts an index block, and last is at
+ * most the end of that block */
+static void capfile_summarise(struct capfile_summary* cs, uint32_t const* values, uint32_t first, uint32_t last)
+{
+	struct capfile_index ent = {
+		.transitions = cs->transitions,
+		.value = values[0],
+		.toggled = 0,
+	};
+	for(uint32_t i = 0; i < last - first; i += 1) {
+		uint32_t const diff = values[i] ^ cs->prev;
+		ent.toggled |= diff;
+		cs->transitions += diff != 0;
+		cs->prev = values[i];
+	}
+	memcpy(&cs->index[(size_t)(first / CAPFILE_INDEX_INTERVAL) * sizeof(ent)], &ent, sizeof(ent));
+
+	if(cs->overview) {
+		for(uint32_t from = 0; from < last - first; from += CAPFILE_OVERVIEW_BLOCK) {
+			uint32_t const to = last - first - from > CAPFILE_OVERVIEW_BLOCK? from + CAPFILE_OVERVIEW_BLOCK : last - first;
+			struct capfile_overview ov = { .all_high = ~(uint32_t)0, .any_high = 0 };
+			for(uint32_t i = from; i < to; i += 1) {
+				ov.all_high &= values[i];
+				ov.any_high |= values[i];
+			}
+			memcpy(&cs->overview[(size_t)((first + from) / CAPFILE_OVERVIEW_BLOCK) * sizeof(ov)], &ov, sizeof(ov));
+		}
+	}
+}
+
+/* The overview levels above 0, each from the one below */
+static void capfile_overview_levels_above(uint8_t* overview, uint32_t num_samples)
+{
+	size_t below = 0;
+	size_t num_below = (num_samples + CAPFILE_OVERVIEW_BLOCK - 1) / CAPFILE_OVERVIEW_BLOCK;
+	size_t ent = num_below;
+	while(num_below > 1) {
+		size_t const level = ent;
+		for(size_t j = 0; j < num_below; j += 2) {
+			struct capfile_overview ov, next;
+			memcpy(&ov, &overview[(below + j) * sizeof(ov)], sizeof(ov));
+			if(j + 1 < num_below) {
+				memcpy(&next, &overview[(below + j + 1) * sizeof(next)], sizeof(next));
+				ov.all_high &= next.all_high;
+				ov.any_high |= next.any_high;
+			}
+			memcpy(&overview[ent * sizeof(ov)], &ov, sizeof(ov));
+			ent += 1;
+		}
+		below = level;
+		num_below = ent - level;
+	}
+	assert(ent == capfile_overview_entries(num_samples));
+}
+
+/* Everything after the samples: padding and the index, then with an
+ * overview more padding and the overview. tail points at the start of
+ * the padding, and values are read an index block at a time through
+ * get_block. */
+static void fill_capfile_tail(uint8_t* tail, struct cfg const* cfg, uint32_t num_samples,
+	uint32_t const* (*get_block)(void* ctx, uint32_t first, uint32_t last), void* ctx)
+{
+	uint64_t const samples_end = capfile_align(capfile_header_bytes(cfg)) +
+		(uint64_t)num_samples * cfg->num_groups_enabled;
+	size_t const pad = capfile_align(samples_end) - samples_end;
+	size_t const index_bytes = capfile_index_bytes(num_samples);
+	/* The index starts on a page boundary, so its size gives the padding */
+	size_t const index_pad = capfile_align(index_bytes) - index_bytes;
+	memset(tail, 0, pad);
+	struct capfile_summary cs = {
+		.index = tail + pad,
+		.overview = cfg->overview? tail + pad + index_bytes + index_pad : NULL,
+		.transitions = 0,
+		.prev = 0,
+	};
+	if(cfg->overview) {
+		memset(tail + pad + index_bytes, 0, index_pad);
+	}
+	for(uint32_t first = 0; first < num_samples; first += CAPFILE_INDEX_INTERVAL) {
+		uint32_t const last = num_samples - first > CAPFILE_INDEX_INTERVAL? first + CAPFILE_INDEX_INTERVAL : num_samples;
+		capfile_summarise(&cs, get_block(ctx, first, last), first, last);
+	}
+	if(cfg->overview) {
+		capfile_overview_levels_above(cs.overview, num_samples);
+	}
+}
+
+static uint32_t const* capfile_values_block(void* ctx, uint32_t first, uint32_t last)
+{
+	(void)last;
+	return &((uint32_t const*)ctx)[first];
+}
+
+/* The tail of a capture file from all the sample values */
+static void write_capfile_tail(struct outbuf* ob, struct cfg const* cfg,
+	uint32_t const* values, uint32_t num_samples)
+{
+	size_t const bytes = capfile_bytes(cfg, num_samples) -
+		(capfile_align(capfile_header_bytes(cfg)) + (uint64_t)num_samples * cfg->num_groups_enabled);
+	fill_capfile_tail((uint8_t*)outbuf_reserve(ob, bytes), cfg, num_samples,
+		capfile_values_block, (void*)values);
+	ob->len += bytes;
+}
+
+/* Assembles the values of an index block from the samples of a mapped
+ * capture file into a block sized buffer */
+struct capfile_block_reader {
+	uint8_t const* samples;
+	unsigned groups;
+	uint32_t values[CAPFILE_INDEX_INTERVAL];
+};
+
+static uint32_t const* capfile_read_block(void* ctx, uint32_t first, uint32_t last)
+{
+	struct capfile_block_reader* br = ctx;
+	for(uint32_t i = first; i < last; i += 1) {
+		uint32_t v = 0;
+		for(unsigned j = br->groups; j > 0; j -= 1) {
+			v = (v << 8) | br->samples[(size_t)i * br->groups + j - 1];
+		}
+		br->values[i - first] = v;
+	}
+	return br->values;
+}
+
+/* Fill in the header, index and overview of a capture file mapped in memory,
+ * the samples already being in place. The index and overview are built
+ * straight from the sample bytes, without a copy of the samples. */
+static void write_mapped_capfile(uint8_t* file, struct cfg const* cfg, uint32_t num_samples)
+{
+	struct outbuf ob = { .data = NULL };
+	write_capfile_header(&ob, cfg, num_samples);
+	memcpy(file, ob.data, ob.len);
+	outbuf_free(&ob);
+
+	size_t const samples_offset = capfile_align(capfile_header_bytes(cfg));
+	struct capfile_block_reader* br = malloc(sizeof(*br));
+	assert(br);
+	br->samples = &file[samples_offset];
+	br->groups = cfg->num_groups_enabled;
+	fill_capfile_tail(&file[samples_offset + (size_t)num_samples * br->groups], cfg, num_samples,
+		capfile_read_block, br);
+	free(br);
+}
+
+/* Where the formatted output of each capture goes: stdout or a file, one file
+ * per capture (cycling through 'rotate' of them), or with several captures
+ * to one stream each one framed with a header line giving its length */
+struct output {
+	char const* path;
+	bool per_capture;
+	uint32_t rotate;
+	bool framed;
+	int fd;
+	struct outbuf frame;
+	uint64_t bytes; /* Written for the current capture */
+};
+
+/* Check the path has exactly one %u/%d style conversion (and no other %) */
+static bool output_path_has_index(char const* path)
+{
+	unsigned conversions = 0;
+	for(char const* p = path; *p; p += 1) {
+		if(*p != '%') {
+			continue;
+		}
+		p += 1;
+		if(*p == '%') {
+			continue;
+		}
+		while(*p >= '0' && *p <= '9') {
+			p += 1;
+		}
+		if(*p != 'u' && *p != 'd') {
+			return false;
+		}
+		conversions += 1;
+	}
+	return conversions == 1;
+}
+
+static void output_init(struct output* out, struct cfg const* cfg)
+{
+	out->path = cfg->output_path;
+	out->per_capture = out->path && output_path_has_index(out->path);
+	out->rotate = cfg->rotate;
+	out->framed = cfg->repeat != 1 && !out->per_capture;
+	out->fd = STDOUT_FILENO;
+	out->frame = (struct outbuf){ .data = NULL };
+
+	if(out->path && !out->per_capture) {
+		out->fd = open(out->path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+		if(out->fd == -1) {
+			fprintf(stderr, "Error opening %s: %s\n", out->path, strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+static void output_begin(struct output* out, uint32_t index)
+{
+	if(out->per_capture) {
+		char path[4096];
+		#pragma GCC diagnostic push
+		#pragma GCC diagnostic ignored "-Wformat-nonliteral"
+		snprintf(path, sizeof(path), out->path, out->rotate? index % out->rotate : index);
+		#pragma GCC diagnostic pop
+		out->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+		if(out->fd == -1) {
+			fprintf(stderr, "Error opening %s: %s\n", path, strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+	}
+	out->frame.len = 0;
+	out->bytes = 0;
+}
+
+static void output_write(struct output* out, void const* data, size_t len)
+{
+	out->bytes += len;
+	if(out->framed) {
+		memcpy(outbuf_reserve(&out->frame, len), data, len);
+		out->frame.len += len;
+	}
+	else {
+		write_all(out->fd, data, len);
+	}
+}
+
+static void output_end(struct output* out, uint32_t index)
+{
+	if(out->framed) {
+		char header[64];
+		int n = snprintf(header, sizeof(header), "SUMP-CAPTURE %u %zu\n", index, out->frame.len);
+		write_all(out->fd, header, n);
+		write_all(out->fd, out->frame.data, out->frame.len);
+	}
+	if(out->per_capture) {
+		close(out->fd);
+		out->fd = -1;
+	}
+}
+
+/* Raw and capfile output to a regular file is read straight into place
+ * through a mapping of the file instead of being written. This extends the
+ * file by len bytes at the current position and maps them, returning false if
+ * the output can't be mapped (not a file, opened write only etc). */
+struct output_map {
+	void* addr;
+	size_t len;
+	off_t start;
+	uint8_t* data;
+};
+
+static bool output_map(struct output* out, size_t len, struct output_map* map)
+{
+	struct stat st;
+	if(out->framed || len == 0 || fstat(out->fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+		return false;
+	}
+	off_t const start = lseek(out->fd, 0, SEEK_CUR);
+	if(start == -1 || ftruncate(out->fd, start + len) == -1) {
+		return false;
+	}
+	off_t const map_start = start - start % sysconf(_SC_PAGESIZE);
+	map->len = start - map_start + len;
+	map->addr = mmap(NULL, map->len, PROT_READ | PROT_WRITE, MAP_SHARED, out->fd, map_start);
+	if(map->addr == MAP_FAILED) {
+		if(ftruncate(out->fd, start) == -1) {
+			perror_exit("Error truncating output");
+		}
+		return false;
+	}
+	map->start = start;
+	map->data = (uint8_t*)map->addr + (start - map_start);
+	return true;
+}
+
+/* Unmap, keeping the first used bytes in the file */
+static void output_unmap(struct output* out, struct output_map* map, size_t used)
+{
+	munmap(map->addr, map->len);
+	if(ftruncate(out->fd, map->start + used) == -1) {
+		perror_exit("Error truncating output");
+	}
+	if(lseek(out->fd, map->start + used, SEEK_SET) == -1) {
+		perror_exit("Error seeking output");
+	}
+	out->bytes += used;
+}
+
+static void output_close(struct output* out)
+{
+	if(out->path && !out->per_capture) {
+		close(out->fd);
+	}
+	outbuf_free(&out->frame);
+}
+
+/* Samples are read by a separate thread while the main thread formats each
+ * chunk of them into memory as soon as it (and the sample preceding it) has
+ * arrived. As the device sends newest first the chunks are formatted in
+ * reverse order, and written out in the right order once all have arrived.
+ */
+#define READOUT_CHUNK_SAMPLES 4096
+#define MAX_FORMAT_THREADS 64
+
+/* Reverse the order of num samples of size bytes each, in place */
+static void reverse_samples(uint8_t* buf, size_t num, unsigned size)
+{
+	for(size_t i = 0, j = num; i + 1 < j; i += 1, j -= 1) {
+		uint8_t tmp[4];
+		memcpy(tmp, &buf[i * size], size);
+		memcpy(&buf[i * size], &buf[(j - 1) * size], size);
+		memcpy(&buf[(j - 1) * size], tmp, size);
+	}
+}
+
+struct readout {
+	struct transport* tp;
+	uint8_t* buf;
+	size_t bytes;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	size_t pos; /* Bytes received so far, protected by lock */
+
+	/* Throughput (from the end of the first read, so no trigger wait) */
+	size_t first_bytes;
+	double t_first, t_last;
+
+	/* When reading straight into a mapped output file: the samples are
+	 * read a chunk at a time into their place counting back from the end of
+	 * map (of bytes length), and each chunk is put in chronological order
+	 * once complete. pos only counts complete chunks. */
+	uint8_t* map;
+	size_t map_chunk;
+	unsigned sample_bytes;
+	size_t received; /* Including a partly read chunk, protected by lock */
+
+	/* Demux mode: bytes per half word, and the kernel to unpack words with
+	 * (pos only counts unpacked words) */
+	unsigned demux_half;
+	demux_fn demux;
+	size_t demuxed;
+
+	/* Send the run command again as soon as the last byte is in */
+	bool rearm;
+	double t_rearm;
+
+	/* Timeouts (see struct cfg) and whether one expired, protected by lock */
+	double trigger_timeout, stall_timeout;
+	bool progress;
+	bool timed_out;
+	double t_run;
+
+	/* read() calls, by power of two size, and time the formatting spent
+	 * waiting for data */
+	uint32_t read_calls;
+	uint32_t read_sizes[32];
+	double t_wait;
+};
+
+static void readout_progress(struct readout const* ro, size_t pos, double now)
+{
+	if(pos == 0) {
+		fprintf(stderr, "\rWaiting for trigger: %.1lfs", now - ro->t_run);
+	}
+	else {
+		double const t = now - ro->t_first;
+		fprintf(stderr, "\rRead %zu of %zu bytes (%.0lf%%), %.0lf bytes/s    ", pos, ro->bytes,
+			100.0 * (double)pos / (double)ro->bytes, t > 0.0? (double)(pos - ro->first_bytes) / t : 0.0);
+	}
+}
+
+/* Wait for data with poll(), returning false if the trigger/stall timeout
+ * expires first. Wakes up regularly to update the progress display. */
+static bool readout_poll(struct readout* ro, size_t pos)
+{
+	double const timeout = pos == 0? ro->trigger_timeout : ro->stall_timeout;
+	if(timeout <= 0.0 && !ro->progress) {
+		return true;
+	}
+
+	double const t_start = monotonic_time();
+	double t_progress = 0.0;
+	while(1) {
+		double const now = monotonic_time();
+		if(ro->progress && now - t_progress >= 0.2) {
+			readout_progress(ro, pos, now);
+			t_progress = now;
+		}
+		int ms = -1;
+		if(timeout > 0.0) {
+			double const left = timeout - (now - t_start);
+			if(left <= 0.0) {
+				return false;
+			}
+			ms = (int)(left * 1e3) + 1;
+		}
+		if(ro->progress && (ms < 0 || ms > 200)) {
+			ms = 200;
+		}
+
+		struct pollfd pfd = { .fd = ro->tp->fd, .events = POLLIN };
+		int r = poll(&pfd, 1, ms);
+		if(r == -1 && errno != EINTR) {
+			perror_exit("poll");
+		}
+		if(r > 0) {
+			return true;
+		}
+	}
+}
+
+static void* readout_thread(void* arg)
+{
+	struct readout* ro = arg;
+	size_t pos = 0;
+	while(pos < ro->bytes) {
+		if(!readout_poll(ro, pos)) {
+			ro->t_last = monotonic_time();
+			if(pos == 0) {
+				ro->t_first = ro->t_last;
+			}
+			if(ro->progress) {
+				fprintf(stderr, "\n");
+			}
+			pthread_mutex_lock(&ro->lock);
+			ro->timed_out = true;
+			pthread_cond_broadcast(&ro->cond);
+			pthread_mutex_unlock(&ro->lock);
+			return NULL;
+		}
+
+		uint8_t* dest = &ro->buf[pos];
+		size_t want = ro->bytes - pos;
+		size_t chunk_start = 0, chunk_end = 0;
+		if(ro->map) {
+			chunk_end = ro->bytes - pos / ro->map_chunk * ro->map_chunk;
+			chunk_start = chunk_end > ro->map_chunk? chunk_end - ro->map_chunk : 0;
+			dest = &ro->map[chunk_start + pos % ro->map_chunk];
+			want = chunk_end - chunk_start - pos % ro->map_chunk;
+		}
+
+		ssize_t sz = read(ro->tp->fd, dest, want);
+		if(sz == -1) {
+			if(errno == EINTR) {
+				continue;
+			}
+			perror_exit("Error reading from device");
+		}
+		if(sz == 0) {
+			fprintf(stderr, "Error reading from device: end of file\n");
+			exit(EXIT_FAILURE);
+		}
+		if(pos == 0) {
+			ro->t_first = monotonic_time();
+			ro->first_bytes = sz;
+		}
+		pos += sz;
+		ro->read_calls += 1;
+		if(sz > 0) {
+			ro->read_sizes[31 - __builtin_clz((uint32_t)sz)] += 1;
+		}
+
+		size_t avail = pos;
+		if(ro->map) {
+			if((size_t)sz == want) {
+				uint8_t* chunk = &ro->map[chunk_start];
+				size_t const len = chunk_end - chunk_start;
+				if(ro->demux_half) {
+					ro->demux(chunk, len / (ro->demux_half * 2), ro->demux_half);
+				}
+				reverse_samples(chunk, len / ro->sample_bytes, ro->sample_bytes);
+			}
+			avail = pos - pos % ro->map_chunk;
+			if(pos == ro->bytes) {
+				avail = pos;
+			}
+		}
+		else if(ro->demux_half) {
+			unsigned const word = ro->demux_half * 2;
+			avail = pos - pos % word;
+			ro->demux(&ro->buf[ro->demuxed], (avail - ro->demuxed) / word, ro->demux_half);
+			ro->demuxed = avail;
+		}
+
+		pthread_mutex_lock(&ro->lock);
+		ro->pos = avail;
+		ro->received = pos;
+		pthread_cond_broadcast(&ro->cond);
+		pthread_mutex_unlock(&ro->lock);
+	}
+	ro->t_last = monotonic_time();
+	if(ro->progress) {
+		readout_progress(ro, pos, ro->t_last);
+		fprintf(stderr, "\n");
+	}
+	if(ro->rearm) {
+		transport_send(ro->tp, &cmd_run);
+		transport_flush(ro->tp);
+		ro->t_rearm = monotonic_time();
+	}
+	return NULL;
+}
+
+/* A mapped readout that timed out: copy what did arrive back out into a
+ * buffer in the order the device sent it (unpacked if demuxed), as salvage
+ * expects, and drop the file */
+static uint8_t* unmap_readout(struct readout* ro, size_t word_bytes)
+{
+	size_t const got = ro->received - ro->received % word_bytes;
+	uint8_t* buf = malloc(got? got : 1);
+	assert(buf);
+	for(size_t pos = 0; pos < got; pos += ro->map_chunk) {
+		size_t const end = ro->bytes - pos;
+		size_t const start = end > ro->map_chunk? end - ro->map_chunk : 0;
+		size_t const len = got - pos < end - start? got - pos : end - start;
+		memcpy(&buf[pos], &ro->map[start], len);
+		if(len == end - start) {
+			/* Complete chunks have been put in chronological order */
+			reverse_samples(&buf[pos], len / ro->sample_bytes, ro->sample_bytes);
+		}
+		else if(ro->demux_half) {
+			ro->demux(&buf[pos], len / word_bytes, ro->demux_half);
+		}
+	}
+	ro->map = NULL;
+	ro->pos = got;
+	return buf;
+}
+
+/* Returns false if the readout timed out before that much arrived */
+static bool readout_wait(struct readout* ro, size_t bytes)
+{
+	pthread_mutex_lock(&ro->lock);
+	if(ro->pos < bytes) {
+		double const t = monotonic_time();
+		while(ro->pos < bytes && !ro->timed_out) {
+			pthread_cond_wait(&ro->cond, &ro->lock);
+		}
+		ro->t_wait += monotonic_time() - t;
+	}
+	bool const ok = ro->pos >= bytes;
+	pthread_mutex_unlock(&ro->lock);
+	return ok;
+}
+
+/* Compressed sample files: a header, then the samples in chunks of
+ * chunk_samples (the first may be shorter, as chunks are counted back from
+ * the newest sample), each only recording where the
+ * sample value changes. The value before the first sample is taken as 0.
+ *
+ * Numbers are unsigned LEB128 varints. A chunk is normally the number of
+ * changes, then for each the distance from the previous change (or from the
+ * start of the chunk) and the bits that changed. With SUMPZ_BITPLANES each
+ * channel (bit of the samples, up to bytes_per_sample * 8) is instead stored
+ * on its own: the number of times it toggles in the chunk and the distances
+ * between them, which suits slowly toggling lines. Chunks only depend on the
+ * value they start with, so can be encoded as they arrive.
+ */
+#define SUMPZ_VERSION 1
+#define SUMPZ_BITPLANES 0x1
+#define SUMPZ_TRUNCATED 0x2
+
+struct sumpz_header {
+	char magic[8]; /* "SUMPZ" */
+	uint32_t version;
+	uint32_t header_bytes;
+	uint32_t flags;
+	uint32_t num_samples, chunk_samples, bytes_per_sample;
+	uint32_t trigger_sample, requested_samples;
+	uint32_t group_enable, num_probes, clk_freq_hz, clk_divisor;
+};
+
+static inline void put_varint(struct outbuf* ob, uint64_t v)
+{
+	uint8_t* p = (uint8_t*)outbuf_reserve(ob, 10);
+	uint8_t* const start = p;
+	while(v >= 0x80) {
+		*p++ = (v & 0x7F) | 0x80;
+		v >>= 7;
+	}
+	*p++ = v;
+	ob->len += p - start;
+}
+
+/* Returns false if the data ran out or the varint is too long */
+static inline bool get_varint(uint8_t const** p, uint8_t const* end, uint64_t* v)
+{
+	*v = 0;
+	for(unsigned shift = 0; *p < end && shift < 64; shift += 7) {
+		uint8_t const b = *(*p)++;
+		*v |= (uint64_t)(b & 0x7F) << shift;
+		if(!(b & 0x80)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static void write_sumpz_header(struct outbuf* ob, struct cfg const* cfg, uint32_t num_samples)
+{
+	struct sumpz_header hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, "SUMPZ", 6);
+	hdr.version = SUMPZ_VERSION;
+	hdr.header_bytes = sizeof(hdr);
+	hdr.flags = (cfg->bitplanes? SUMPZ_BITPLANES : 0) | (cfg->truncated_from? SUMPZ_TRUNCATED : 0);
+	hdr.num_samples = num_samples;
+	hdr.chunk_samples = READOUT_CHUNK_SAMPLES;
+	hdr.bytes_per_sample = cfg->num_groups_enabled;
+	hdr.trigger_sample = cfg->before_trig;
+	hdr.requested_samples = cfg->truncated_from? cfg->truncated_from : num_samples;
+	hdr.group_enable = cfg->group_enable & cfg->group_mask;
+	hdr.num_probes = cfg->num_probes;
+	hdr.clk_freq_hz = cfg->clk_freq_hz;
+	hdr.clk_divisor = cfg->clk_divisor;
+	memcpy(outbuf_reserve(ob, sizeof(hdr)), &hdr, sizeof(hdr));
+	ob->len += sizeof(hdr);
+}
+
+/* Encode the changes (from assembly) of the chunk starting at sample first */
+static void write_sumpz_chunk(struct outbuf* ob, struct cfg const* cfg, uint32_t first,
+	struct changes const* chg)
+{
+	if(!cfg->bitplanes) {
+		put_varint(ob, chg->count);
+		uint64_t last = first;
+		for(uint32_t c = 0; c < chg->count; c += 1) {
+			put_varint(ob, chg->index[c] - last);
+			put_varint(ob, chg->mask[c]);
+			last = chg->index[c];
+		}
+		return;
+	}
+
+	uint32_t toggles[32] = { 0 };
+	for(uint32_t c = 0; c < chg->count; c += 1) {
+		for(uint32_t m = chg->mask[c]; m; m &= m - 1) {
+			toggles[__builtin_ctz(m)] += 1;
+		}
+	}
+	for(unsigned b = 0; b < cfg->num_groups_enabled * 8; b += 1) {
+		put_varint(ob, toggles[b]);
+		if(toggles[b] == 0) {
+			continue;
+		}
+		uint64_t last = first;
+		for(uint32_t c = 0; c < chg->count; c += 1) {
+			if(chg->mask[c] & (1u << b)) {
+				put_varint(ob, chg->index[c] - last);
+				last = chg->index[c];
+			}
+		}
+	}
+}
+
+/* Decode the samples after the header into raw (chronological) sample bytes,
+ * returning false if the data is malformed */
+static bool sumpz_decode(struct sumpz_header const* hdr, uint8_t const* data, size_t len, uint8_t* samples)
+{
+	uint8_t const* p = data;
+	uint8_t const* const end = data + len;
+	unsigned const groups = hdr->bytes_per_sample;
+	uint32_t const chunk = hdr->chunk_samples;
+	uint32_t* toggled = malloc((size_t)chunk * sizeof(uint32_t));
+	assert(toggled);
+
+	bool ok = true;
+	uint32_t value = 0;
+	uint32_t n = hdr->num_samples % chunk? hdr->num_samples % chunk : chunk;
+	for(uint32_t first = 0; ok && first < hdr->num_samples; first += n, n = chunk) {
+		memset(toggled, 0, (size_t)n * sizeof(uint32_t));
+		uint64_t count, delta, bits;
+		if(!(hdr->flags & SUMPZ_BITPLANES)) {
+			ok = get_varint(&p, end, &count);
+			for(uint64_t c = 0, at = 0; ok && c < count; c += 1) {
+				ok = get_varint(&p, end, &delta) && get_varint(&p, end, &bits) && (at += delta) < n;
+				if(ok) {
+					toggled[at] |= bits;
+				}
+			}
+		}
+		else {
+			for(unsigned b = 0; ok && b < groups * 8; b += 1) {
+				ok = get_varint(&p, end, &count);
+				for(uint64_t c = 0, at = 0; ok && c < count; c += 1) {
+					ok = get_varint(&p, end, &delta) && (at += delta) < n;
+					if(ok) {
+						toggled[at] |= 1u << b;
+					}
+				}
+			}
+		}
+
+		uint8_t* out = &samples[(size_t)first * groups];
+		for(uint32_t i = 0; ok && i < n; i += 1) {
+			value ^= toggled[i];
+			for(unsigned j = 0; j < groups; j += 1) {
+				*out++ = value >> (j * 8);
+			}
+		}
+	}
+
+	free(toggled);
+	return ok && p == end;
+}
+
+/* Segmented captures are written as one output, each segment placed at the
+ * time it was taken. The device doesn't say when that was, so it's taken
+ * from when the data started arriving (the device sends as soon as the
+ * capture memory is full), and segments are kept at least a sample apart so
+ * the gap between them can be marked: VCD values go to x, hex output gets a
+ * comment line.
+ */
+struct segment_state {
+	uint32_t index; /* Of the segment being written */
+	double t_origin; /* Host time of the first sample of segment 0 */
+	double t_end; /* And of the newest sample of the last segment */
+	uint64_t offset; /* Position of this segment's first sample, in samples from t_origin */
+	uint64_t next; /* Earliest position for the next segment */
+	uint32_t last_value; /* Newest sample of the last segment */
+};
+
+/* Work out where the segment goes, once its first data is in */
+static bool segment_place(struct readout* ro, struct cfg const* cfg, uint32_t num_samples)
+{
+	struct segment_state* seg = cfg->segment;
+	if(!readout_wait(ro, ro->bytes < cfg->num_groups_enabled? ro->bytes : cfg->num_groups_enabled)) {
+		return false;
+	}
+	double const period = (double)cfg->clk_divisor / cfg->clk_freq_hz;
+	double const t_start = ro->t_first - num_samples * period;
+	if(seg->index == 0) {
+		seg->t_origin = t_start;
+		seg->offset = 0;
+	}
+	else {
+		double const pos = (t_start - seg->t_origin) / period;
+		seg->offset = pos > (double)seg->next? (uint64_t)pos : seg->next;
+	}
+	return true;
+}
+
+static void write_vcd_unknowns(struct outbuf* ob, struct vcd_writer const* vw)
+{
+	for(unsigned vali = 0; vali < vw->cfg->vcd.num_values; vali += 1) {
+		struct vcd_writer_value const* wv = &vw->values[vali];
+		outbuf_printf(ob, "%sx%s%.*s\n", wv->num_bits > 1? "b" : "", wv->num_bits > 1? " " : "",
+			wv->id_len, wv->id);
+	}
+}
+
+static void write_segment_marker(struct outbuf* ob, struct cfg const* cfg, struct vcd_writer const* vw)
+{
+	struct segment_state const* seg = cfg->segment;
+	double const period = (double)cfg->clk_divisor / cfg->clk_freq_hz;
+	double const t_start = seg->t_origin + seg->offset * period;
+	if(vw && seg->index == 0) {
+		write_vcd_header(ob, vw);
+	}
+	else if(vw) {
+		outbuf_printf(ob, "#%llu\n", (unsigned long long)((double)(seg->next - 1) * vw->ts.period));
+		outbuf_printf(ob, "$comment\n   Segment %u, after a gap of %.6lfs\n$end\n",
+			seg->index, t_start - seg->t_end);
+		write_vcd_unknowns(ob, vw);
+	}
+	else if(seg->index == 0) {
+		outbuf_printf(ob, "# Segment 0\n");
+	}
+	else {
+		outbuf_printf(ob, "# Segment %u at +%.6lfs, after a gap of %.6lfs\n",
+			seg->index, t_start - seg->t_origin, t_start - seg->t_end);
+	}
+}
+
+/* Format samples chunk by chunk as they arrive, see above. Chunks only
+ * depend on the sample before them, so with the threads option several are
+ * formatted at once, each into its own buffer, and written out in order at
+ * the end as usual. */
+struct format_job {
+	struct readout* ro;
+	struct cfg const* cfg;
+	struct vcd_writer const* vw;
+	assemble_fn assemble;
+	uint32_t num_samples;
+	uint32_t* values;
+	struct outbuf* chunks;
+	uint32_t num_chunks;
+
+	pthread_mutex_t lock;
+	uint32_t next;
+	bool complete;
+};
+
+static bool format_chunk(struct format_job* job, uint32_t k, struct changes* chg)
+{
+	struct cfg const* cfg = job->cfg;
+	uint8_t const* buf = job->ro->buf;
+	uint32_t const num_samples = job->num_samples;
+	uint32_t const last = num_samples - k * READOUT_CHUNK_SAMPLES;
+	uint32_t const first = last > READOUT_CHUNK_SAMPLES? last - READOUT_CHUNK_SAMPLES : 0;
+
+	/* Change detection needs the sample before the chunk too */
+	uint32_t const needed = num_samples - first + (first > 0? 1 : 0);
+	if(!readout_wait(job->ro, (size_t)needed * cfg->num_groups_enabled)) {
+		return false;
+	}
+
+	if(cfg->raw) {
+		write_raw_samples(&job->chunks[k], cfg, buf, num_samples, first, last);
+		return true;
+	}
+
+	uint32_t prev = first > 0? sample_at(cfg, buf, num_samples, first - 1) : 0;
+	if(first == 0 && cfg->segment && cfg->segment->index > 0) {
+		/* Everything has to be written again after a gap */
+		prev = ~sample_at(cfg, buf, num_samples, 0);
+	}
+	chg->count = 0;
+	job->assemble(cfg->num_groups_enabled, buf, num_samples, first, last, prev, job->values, chg);
+	if(cfg->capfile) {
+		/* Only the values are needed, for the index */
+		write_raw_samples(&job->chunks[k], cfg, buf, num_samples, first, last);
+		return true;
+	}
+	if(cfg->compress) {
+		write_sumpz_chunk(&job->chunks[k], cfg, first, chg);
+		return true;
+	}
+	if(k == 0 && (chg->count == 0 || chg->index[chg->count - 1] != num_samples - 1)) {
+		/* VCD writes everything at the final sample */
+		chg->index[chg->count] = num_samples - 1;
+		chg->mask[chg->count] = 0;
+		chg->value[chg->count] = job->values[num_samples - 1];
+		chg->count += 1;
+	}
+
+	if(job->vw) {
+		write_vcd_changes(&job->chunks[k], job->vw, num_samples, chg);
+	}
+	else {
+		write_hex_changes(&job->chunks[k], cfg, first, last, prev, chg);
+	}
+	return true;
+}
+
+/* Take chunks, newest (first to arrive) first, until they run out */
+static void* format_worker(void* arg)
+{
+	struct format_job* job = arg;
+	/* Room for every sample in a chunk changing, plus the forced final one */
+	struct changes chg = {
+		.index = malloc((READOUT_CHUNK_SAMPLES + 1) * sizeof(uint64_t)),
+		.mask = malloc((READOUT_CHUNK_SAMPLES + 1) * sizeof(uint32_t)),
+		.value = malloc((READOUT_CHUNK_SAMPLES + 1) * sizeof(uint32_t)),
+	};
+	assert(chg.index && chg.mask && chg.value);
+
+	while(1) {
+		pthread_mutex_lock(&job->lock);
+		uint32_t const k = job->next;
+		bool const done = k >= job->num_chunks || !job->complete;
+		job->next += 1;
+		pthread_mutex_unlock(&job->lock);
+		if(done) {
+			break;
+		}
+
+		if(!format_chunk(job, k, &chg)) {
+			pthread_mutex_lock(&job->lock);
+			job->complete = false;
+			pthread_mutex_unlock(&job->lock);
+			break;
+		}
+	}
+
+	free(chg.index);
+	free(chg.mask);
+	free(chg.value);
+	return NULL;
+}
+
+/* Returns false, without writing anything, if the readout timed out */
+static bool write_chunked_samples(struct readout* ro, struct cfg const* cfg,
+	struct vcd_writer const* vw, struct output* out, uint32_t num_samples)
+{
+	uint32_t* values = malloc((size_t)num_samples * sizeof(uint32_t));
+	assert(num_samples == 0 || values);
+
+	uint32_t const num_chunks = (num_samples + READOUT_CHUNK_SAMPLES - 1) / READOUT_CHUNK_SAMPLES;
+	struct outbuf* chunks = calloc(num_chunks, sizeof(struct outbuf));
+	assert(num_chunks == 0 || chunks);
+
+	struct format_job job = {
+		.ro = ro,
+		.cfg = cfg,
+		.vw = vw,
+		.assemble = select_assemble_kernel(cfg->simd),
+		.num_samples = num_samples,
+		.values = values,
+		.chunks = chunks,
+		.num_chunks = num_chunks,
+		.next = 0,
+		.complete = true,
+	};
+	pthread_mutex_init(&job.lock, NULL);
+
+	/* This thread is one of the workers */
+	unsigned num_threads = cfg->threads > num_chunks? num_chunks : cfg->threads;
+	pthread_t threads[MAX_FORMAT_THREADS];
+	for(unsigned t = 1; t < num_threads; t += 1) {
+		int err = pthread_create(&threads[t], NULL, format_worker, &job);
+		if(err) {
+			fprintf(stderr, "Error creating format thread: %s\n", strerror(err));
+			exit(EXIT_FAILURE);
+		}
+	}
+	format_worker(&job);
+	for(unsigned t = 1; t < num_threads; t += 1) {
+		pthread_join(threads[t], NULL);
+	}
+	pthread_mutex_destroy(&job.lock);
+	bool const complete = job.complete;
+
+	/* Everything has arrived once the first chunk is done */
+	if(complete && (vw || cfg->capfile || cfg->compress || cfg->segment || (cfg->truncated_from && !cfg->raw))) {
+		struct outbuf header = { .data = NULL };
+		if(cfg->segment) {
+			write_segment_marker(&header, cfg, vw);
+		}
+		else if(vw) {
+			write_vcd_header(&header, vw);
+		}
+		else if(cfg->capfile) {
+			write_capfile_header(&header, cfg, num_samples);
+		}
+		else if(cfg->compress) {
+			write_sumpz_header(&header, cfg, num_samples);
+		}
+		else {
+			outbuf_printf(&header, "# Truncated capture: %u of %u samples received\n",
+				num_samples, cfg->truncated_from);
+		}
+		output_write(out, header.data, header.len);
+		outbuf_free(&header);
+	}
+	size_t chunk_bytes = 0;
+	for(uint32_t k = num_chunks; k > 0; k -= 1) {
+		if(complete) {
+			output_write(out, chunks[k - 1].data, chunks[k - 1].len);
+		}
+		chunk_bytes += chunks[k - 1].len;
+		outbuf_free(&chunks[k - 1]);
+	}
+	if(complete && cfg->compress && cfg->verbosity) {
+		size_t const raw_bytes = (size_t)num_samples * cfg->num_groups_enabled;
+		fprintf(stderr, "Compressed %zu bytes of samples to %zu (%.1fx)\n", raw_bytes, chunk_bytes,
+			chunk_bytes? (double)raw_bytes / chunk_bytes : 0.0);
+	}
+	if(complete && cfg->capfile) {
+		struct outbuf index = { .data = NULL };
+		write_capfile_tail(&index, cfg, values, num_samples);
+		output_write(out, index.data, index.len);
+		outbuf_free(&index);
+	}
+
+	free(chunks);
+	free(values);
+	return complete;
+}
+
+/* RLE captures: a word with the top bit of the enabled group width set is a
+ * count of how many more times the value before it (in time) was repeated.
+ * Words arrive newest first, so a count is seen just before its value.
+ *
+ * Runs are decoded as the words arrive, but their start times are only known
+ * once the oldest word is in, so output is written after that, straight from
+ * the runs.
+ */
+struct rle_runs {
+	uint32_t* value;
+	uint64_t* length;
+	uint32_t count;
+	uint64_t pending; /* Count words seen but not yet applied to a value */
+};
+
+static void rle_decode(struct cfg const* cfg, uint8_t const* buf, uint32_t first_word, uint32_t last_word,
+	struct rle_runs* runs)
+{
+	unsigned const groups = cfg->num_groups_enabled;
+	uint32_t const flag = 1u << (groups * 8 - 1);
+	for(uint32_t w = first_word; w < last_word; w += 1) {
+		uint8_t const* ptr = &buf[(size_t)w * groups];
+		uint32_t word = 0;
+		for(unsigned j = groups; j > 0; j -= 1) {
+			word = (word << 8) | ptr[j - 1];
+		}
+		if(word & flag) {
+			runs->pending += word & ~flag;
+		}
+		else {
+			runs->value[runs->count] = word;
+			runs->length[runs->count] = 1 + runs->pending;
+			runs->pending = 0;
+			runs->count += 1;
+		}
+	}
+}
+
+#define RLE_OUTPUT_BATCH 65536
+
+/* Decode all the runs as the words arrive, returning false (with nothing
+ * allocated) if the readout timed out */
+static bool rle_read_runs(struct readout* ro, struct cfg const* cfg, uint32_t num_words,
+	struct rle_runs* runs, uint64_t* total)
+{
+	runs->value = malloc((size_t)num_words * sizeof(uint32_t));
+	runs->length = malloc((size_t)num_words * sizeof(uint64_t));
+	runs->count = 0;
+	runs->pending = 0;
+	assert(num_words == 0 || (runs->value && runs->length));
+
+	for(uint32_t w = 0; w < num_words; w += READOUT_CHUNK_SAMPLES) {
+		uint32_t const last = num_words - w > READOUT_CHUNK_SAMPLES? w + READOUT_CHUNK_SAMPLES : num_words;
+		if(!readout_wait(ro, (size_t)last * cfg->num_groups_enabled)) {
+			free(runs->value);
+			free(runs->length);
+			return false;
+		}
+		rle_decode(cfg, ro->buf, w, last, runs);
+	}
+	if(runs->pending) {
+		fprintf(stderr, "Warning: RLE count at start of capture with no value, ignored\n");
+	}
+
+	*total = 0;
+	for(uint32_t r = 0; r < runs->count; r += 1) {
+		*total += runs->length[r];
+	}
+	if(cfg->verbosity) {
+		fprintf(stderr, "RLE: %u words, %u runs, %llu samples\n", num_words, runs->count, (unsigned long long)*total);
+	}
+	return true;
+}
+
+static bool write_rle_runs(struct readout* ro, struct cfg const* cfg,
+	struct vcd_writer const* vw, struct output* out, uint32_t num_words)
+{
+	struct rle_runs runs;
+	uint64_t total;
+	if(!rle_read_runs(ro, cfg, num_words, &runs, &total)) {
+		return false;
+	}
+
+	struct outbuf ob = { .data = NULL };
+	if(vw) {
+		write_vcd_header(&ob, vw);
+	}
+	else if(cfg->truncated_from) {
+		outbuf_printf(&ob, "# Truncated capture: %u of %u words received\n",
+			num_words, cfg->truncated_from);
+	}
+
+	/* Walk the runs oldest first, turning them into change lists a batch at
+	 * a time */
+	struct changes chg = {
+		.index = malloc((RLE_OUTPUT_BATCH + 1) * sizeof(uint64_t)),
+		.mask = malloc((RLE_OUTPUT_BATCH + 1) * sizeof(uint32_t)),
+		.value = malloc((RLE_OUTPUT_BATCH + 1) * sizeof(uint32_t)),
+		.count = 0,
+	};
+	assert(chg.index && chg.mask && chg.value);
+
+	uint64_t t = 0;
+	uint32_t prev = 0;
+	for(uint32_t r = runs.count; r > 0; r -= 1) {
+		uint32_t const v = runs.value[r - 1];
+		uint64_t const len = runs.length[r - 1];
+		if(vw) {
+			if(v != prev) {
+				chg.index[chg.count] = t;
+				chg.mask[chg.count] = v ^ prev;
+				chg.value[chg.count] = v;
+				chg.count += 1;
+			}
+			if(r == 1 && (chg.count == 0 || chg.index[chg.count - 1] != total - 1)) {
+				chg.index[chg.count] = total - 1;
+				chg.mask[chg.count] = 0;
+				chg.value[chg.count] = v;
+				chg.count += 1;
+			}
+			if(chg.count >= RLE_OUTPUT_BATCH || r == 1) {
+				write_vcd_changes(&ob, vw, total, &chg);
+				chg.count = 0;
+			}
+		}
+		else {
+			/* Hex output is one line per sample regardless */
+			for(uint64_t done = 0; done < len; ) {
+				uint64_t const n = len - done > RLE_OUTPUT_BATCH? RLE_OUTPUT_BATCH : len - done;
+				chg.index[0] = t + done;
+				chg.mask[0] = v ^ prev;
+				chg.value[0] = v;
+				chg.count = 1;
+				write_hex_changes(&ob, cfg, t + done, t + done + n, prev, &chg);
+				done += n;
+				if(ob.len >= (1u << 20)) {
+					output_write(out, ob.data, ob.len);
+					ob.len = 0;
+				}
+			}
+		}
+		if(ob.len >= (1u << 20)) {
+			output_write(out, ob.data, ob.len);
+			ob.len = 0;
+		}
+		prev = v;
+		t += len;
+	}
+	output_write(out, ob.data, ob.len);
+
+	outbuf_free(&ob);
+	free(chg.index);
+	free(chg.mask);
+	free(chg.value);
+	free(runs.value);
+	free(runs.length);
+	return true;
+}
+
+/* Measure mode: rather than writing the samples out, work out edge counts,
+ * frequency, duty cycle and pulse width statistics for each channel (or each
+ * vcd value, which counts as high when any of its bits are set) in one pass
+ * over the changes, and write a short report.
+ *
+ * Only pulses with an edge at both ends count towards the widths, and the
+ * frequency and duty cycle are taken over the whole periods between the first
+ * and last rising edges.
+ */
+#define MEASURE_HIST_BUCKETS 65 /* Bit lengths 0-64, RLE widths can pass 32 bits */
+
+struct pulse_stats {
+	uint64_t count, min, max, total;
+	uint64_t hist[MEASURE_HIST_BUCKETS]; /* Indexed by bit length of the width */
+};
+
+struct measure_signal {
+	char name[MAX_VCD_NAME_LEN+1];
+	uint32_t mask;
+	bool level;
+	uint64_t last_edge; /* UINT64_MAX before the first edge */
+	uint64_t rising, falling, changes;
+	uint64_t first_rise, last_rise;
+	uint64_t high_to_last_rise; /* Total high pulse width before last_rise */
+	struct pulse_stats high, low;
+};
+
+struct measure {
+	uint32_t num_signals;
+	struct measure_signal* signals;
+	uint32_t value;
+};
+
+static void measure_init(struct measure* m, struct cfg const* cfg, uint32_t first)
+{
+	memset(m, 0, sizeof(*m));
+	m->signals = calloc(cfg->vcd.num_values > 32? cfg->vcd.num_values : 32, sizeof(struct measure_signal));
+	assert(m->signals);
+	if(cfg->vcd.num_values) {
+		for(uint32_t v = 0; v < cfg->vcd.num_values; v += 1) {
+			memcpy(m->signals[v].name, cfg->vcd.values[v].name, sizeof(m->signals[v].name));
+			m->signals[v].mask = cfg->vcd.values[v].mask;
+		}
+		m->num_signals = cfg->vcd.num_values;
+	}
+	else {
+		/* Name channels by their number on the device, as disabled groups
+		 * are left out of the samples */
+		unsigned bit = 0;
+		for(unsigned g = 0; g < 4; g += 1) {
+			if(!(cfg->group_enable & cfg->group_mask & (1u << g))) {
+				continue;
+			}
+			for(unsigned c = 0; c < 8; c += 1, bit += 1) {
+				snprintf(m->signals[bit].name, sizeof(m->signals[bit].name), "ch%u", g * 8 + c);
+				m->signals[bit].mask = 1u << bit;
+			}
+		}
+		m->num_signals = bit;
+		/* The top channel is the RLE flag */
+		if(cfg->rle) {
+			m->num_signals -= 1;
+		}
+	}
+
+	for(uint32_t i = 0; i < m->num_signals; i += 1) {
+		struct measure_signal* sig = &m->signals[i];
+		sig->level = (first & sig->mask) != 0;
+		sig->last_edge = UINT64_MAX;
+		sig->high.min = sig->low.min = UINT64_MAX;
+	}
+	m->value = first;
+}
+
+static void pulse_add(struct pulse_stats* ps, uint64_t width)
+{
+	ps->count += 1;
+	ps->total += width;
+	ps->min = width < ps->min? width : ps->min;
+	ps->max = width > ps->max? width : ps->max;
+	ps->hist[64 - __builtin_clzll(width)] += 1;
+}
+
+/* The samples change to value at sample t */
+static void measure_change(struct measure* m, uint64_t t, uint32_t value)
+{
+	uint32_t const changed = value ^ m->value;
+	m->value = value;
+	for(uint32_t i = 0; i < m->num_signals; i += 1) {
+		struct measure_signal* sig = &m->signals[i];
+		if(!(changed & sig->mask)) {
+			continue;
+		}
+		sig->changes += 1;
+		bool const level = (value & sig->mask) != 0;
+		if(level == sig->level) {
+			continue;
+		}
+		if(sig->last_edge != UINT64_MAX) {
+			pulse_add(level? &sig->low : &sig->high, t - sig->last_edge);
+		}
+		if(level) {
+			if(sig->rising == 0) {
+				sig->first_rise = t;
+			}
+			sig->rising += 1;
+			sig->last_rise = t;
+			sig->high_to_last_rise = sig->high.total;
+		}
+		else {
+			sig->falling += 1;
+		}
+		sig->last_edge = t;
+		sig->level = level;
+	}
+}
+
+/* Format a time or frequency with an SI prefix */
+static void fmt_si(char* buf, size_t len, double v, char const* unit)
+{
+	static char const* const prefixes[] = { "p", "n", "u", "m", "", "K", "M", "G" };
+	int p = 4;
+	while(v != 0.0 && v < 1.0 && p > 0) {
+		v *= 1e3;
+		p -= 1;
+	}
+	while(v >= 1e3 && p < 7) {
+		v /= 1e3;
+		p += 1;
+	}
+	snprintf(buf, len, "%.4g%s%s", v, prefixes[p], unit);
+}
+
+static void write_pulse_stats(struct outbuf* ob, char const* label, struct pulse_stats const* ps,
+	double period)
+{
+	if(ps->count == 0) {
+		return;
+	}
+	char min[32], mean[32], max[32];
+	fmt_si(min, sizeof(min), (double)ps->min * period, "s");
+	fmt_si(mean, sizeof(mean), (double)ps->total / ps->count * period, "s");
+	fmt_si(max, sizeof(max), (double)ps->max * period, "s");
+	outbuf_printf(ob, "  %s: %llu pulses, min %s mean %s max %s\n  %s widths (samples):",
+		label, (unsigned long long)ps->count, min, mean, max, label);
+	for(unsigned b = 1; b < MEASURE_HIST_BUCKETS; b += 1) {
+		if(ps->hist[b] && b == 1) {
+			outbuf_printf(ob, " 1:%llu", (unsigned long long)ps->hist[b]);
+		}
+		else if(ps->hist[b]) {
+			outbuf_printf(ob, " %llu-%llu:%llu", 1ull << (b - 1), (2ull << (b - 1)) - 1,
+				(unsigned long long)ps->hist[b]);
+		}
+	}
+	outbuf_printf(ob, "\n");
+}
+
+static void write_measure_report(struct outbuf* ob, struct measure const* m, struct cfg const* cfg,
+	uint64_t total)
+{
+	double const period = (double)cfg->clk_divisor / cfg->clk_freq_hz;
+	char span[32];
+	fmt_si(span, sizeof(span), (double)total * period, "s");
+	outbuf_printf(ob, "# %llu samples, %s\n", (unsigned long long)total, span);
+	if(cfg->truncated_from) {
+		outbuf_printf(ob, "# Truncated capture: %llu of %u samples received\n",
+			(unsigned long long)total, cfg->truncated_from);
+	}
+
+	for(uint32_t i = 0; i < m->num_signals; i += 1) {
+		struct measure_signal const* sig = &m->signals[i];
+		outbuf_printf(ob, "%s: %llu rising, %llu falling", sig->name,
+			(unsigned long long)sig->rising, (unsigned long long)sig->falling);
+		if(__builtin_popcount(sig->mask) > 1) {
+			outbuf_printf(ob, ", %llu changes", (unsigned long long)sig->changes);
+		}
+		if(sig->rising >= 2) {
+			uint64_t const cycles = sig->last_rise - sig->first_rise;
+			char freq[32];
+			fmt_si(freq, sizeof(freq), (double)(sig->rising - 1) / ((double)cycles * period), "Hz");
+			outbuf_printf(ob, ", freq %s, duty %.2f%%", freq,
+				100.0 * (double)sig->high_to_last_rise / (double)cycles);
+		}
+		else if(sig->rising + sig->falling == 0) {
+			outbuf_printf(ob, ", constant %s", sig->level? "high" : "low");
+		}
+		outbuf_printf(ob, "\n");
+		write_pulse_stats(ob, "high", &sig->high, period);
+		write_pulse_stats(ob, "low", &sig->low, period);
+	}
+}
+
+static bool write_measurements(struct readout* ro, struct cfg const* cfg, struct output* out,
+	uint32_t num_samples)
+{
+	struct measure m;
+	uint64_t total = 0;
+	if(cfg->rle) {
+		struct rle_runs runs;
+		if(!rle_read_runs(ro, cfg, num_samples, &runs, &total)) {
+			return false;
+		}
+		/* Runs are newest first */
+		measure_init(&m, cfg, runs.count? runs.value[runs.count - 1] : 0);
+		uint64_t t = 0;
+		for(uint32_t r = runs.count; r > 0; r -= 1) {
+			measure_change(&m, t, runs.value[r - 1]);
+			t += runs.length[r - 1];
+		}
+		free(runs.value);
+		free(runs.length);
+	}
+	else {
+		/* Changes are needed oldest first, which is the last to arrive */
+		if(!readout_wait(ro, (size_t)num_samples * cfg->num_groups_enabled)) {
+			return false;
+		}
+		total = num_samples;
+		assemble_fn const assemble = select_assemble_kernel(cfg->simd);
+		uint32_t* values = malloc((size_t)num_samples * sizeof(uint32_t));
+		struct changes chg = {
+			.index = malloc((READOUT_CHUNK_SAMPLES + 1) * sizeof(uint64_t)),
+			.mask = malloc((READOUT_CHUNK_SAMPLES + 1) * sizeof(uint32_t)),
+			.value = malloc((READOUT_CHUNK_SAMPLES + 1) * sizeof(uint32_t)),
+		};
+		assert((num_samples == 0 || values) && chg.index && chg.mask && chg.value);
+
+		uint32_t prev = num_samples? sample_at(cfg, ro->buf, num_samples, 0) : 0;
+		measure_init(&m, cfg, prev);
+		for(uint32_t first = 0; first < num_samples; first += READOUT_CHUNK_SAMPLES) {
+			uint32_t const last = num_samples - first > READOUT_CHUNK_SAMPLES? first + READOUT_CHUNK_SAMPLES : num_samples;
+			chg.count = 0;
+			assemble(cfg->num_groups_enabled, ro->buf, num_samples, first, last, prev, values, &chg);
+			for(uint32_t c = 0; c < chg.count; c += 1) {
+				measure_change(&m, chg.index[c], chg.value[c]);
+			}
+			prev = values[last - 1];
+		}
+		free(values);
+		free(chg.index);
+		free(chg.mask);
+		free(chg.value);
+	}
+
+	struct outbuf ob = { .data = NULL };
+	write_measure_report(&ob, &m, cfg, total);
+	output_write(out, ob.data, ob.len);
+	outbuf_free(&ob);
+	free(m.signals);
+	return true;
+}
+
+/* Pattern search: find every occurrence of a sequence of mask/value steps in
+ * the capture, each step after the first having to match within a number of
+ * samples of the one before (1 = the next sample). The first step is searched
+ * for over the assembled samples with SIMD compares, the rest only checked
+ * from each candidate. Hits don't overlap: searching carries on after the
+ * sample matching the last step. Either a list of the hits is written, or
+ * only the samples in a window around each one, as hex or VCD.
+ */
+struct find_hit {
+	uint32_t start, end;
+};
+
+/* Index of the first of values[from, to) with (value & mask) == match, or to */
+typedef uint32_t (*find_fn)(uint32_t const* values, uint32_t from, uint32_t to,
+	uint32_t mask, uint32_t match);
+
+static uint32_t find_scalar(uint32_t const* values, uint32_t from, uint32_t to,
+	uint32_t mask, uint32_t match)
+{
+	for(uint32_t i = from; i < to; i += 1) {
+		if((values[i] & mask) == match) {
+			return i;
+		}
+	}
+	return to;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+static uint32_t find_sse2(uint32_t const* values, uint32_t from, uint32_t to,
+	uint32_t mask, uint32_t match)
+{
+	__m128i const m = _mm_set1_epi32(mask);
+	__m128i const v = _mm_set1_epi32(match);
+	uint32_t i = from;
+	for(; i + 4 <= to; i += 4) {
+		__m128i const s = _mm_and_si128(_mm_loadu_si128((__m128i const*)&values[i]), m);
+		unsigned const hit = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(s, v)));
+		if(hit) {
+			return i + __builtin_ctz(hit);
+		}
+	}
+	return find_scalar(values, i, to, mask, match);
+}
+
+__attribute__((target("avx2")))
+static uint32_t find_avx2(uint32_t const* values, uint32_t from, uint32_t to,
+	uint32_t mask, uint32_t match)
+{
+	__m256i const m = _mm256_set1_epi32(mask);
+	__m256i const v = _mm256_set1_epi32(match);
+	uint32_t i = from;
+	/* Two vectors per iteration, most of the time there's nothing there */
+	for(; i + 16 <= to; i += 16) {
+		__m256i const s0 = _mm256_and_si256(_mm256_loadu_si256((__m256i const*)&values[i]), m);
+		__m256i const s1 = _mm256_and_si256(_mm256_loadu_si256((__m256i const*)&values[i + 8]), m);
+		unsigned const hit = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(s0, v)))
+			| (_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(s1, v))) << 8);
+		if(hit) {
+			return i + __builtin_ctz(hit);
+		}
+	}
+	return find_sse2(values, i, to, mask, match);
+}
+#endif
+
+static find_fn select_find_kernel(enum simd_kernel simd)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	if(simd == SIMD_AUTO || simd == SIMD_AVX2) {
+		if(__builtin_cpu_supports("avx2")) {
+			return find_avx2;
+		}
+	}
+	if(simd != SIMD_SCALAR && __builtin_cpu_supports("sse2")) {
+		return find_sse2;
+	}
+#endif
+	(void)simd;
+	return find_scalar;
+}
+
+/* Returns the number of hits, which are put in a malloc-ed array */
+static uint32_t find_hits(struct cfg const* cfg, uint32_t const* values, uint32_t num_samples,
+	struct find_hit** hits)
+{
+	find_fn const find = select_find_kernel(cfg->simd);
+	struct find_step const* steps = cfg->find.steps;
+	uint32_t count = 0, alloced = 0;
+	*hits = NULL;
+
+	uint32_t pos = 0;
+	while(pos < num_samples) {
+		uint32_t const start = find(values, pos, num_samples, steps[0].mask, steps[0].value);
+		if(start == num_samples) {
+			break;
+		}
+		uint32_t end = start;
+		bool matched = true;
+		for(unsigned s = 1; s < cfg->find.num_steps && matched; s += 1) {
+			uint64_t const limit = (uint64_t)end + 1 + steps[s].within;
+			uint32_t const to = limit < num_samples? (uint32_t)limit : num_samples;
+			uint32_t const at = find(values, end + 1, to, steps[s].mask, steps[s].value);
+			matched = at < to;
+			end = at;
+		}
+		if(!matched) {
+			pos = start + 1;
+			continue;
+		}
+		if(count == alloced) {
+			alloced = alloced? alloced * 2 : 64;
+			*hits = realloc(*hits, alloced * sizeof(struct find_hit));
+			assert(*hits);
+		}
+		(*hits)[count++] = (struct find_hit){ .start = start, .end = end };
+		pos = end + 1;
+	}
+	return count;
+}
+
+static void write_find_report(struct outbuf* ob, struct cfg const* cfg, struct find_hit const* hits,
+	uint32_t num_hits, uint32_t num_samples)
+{
+	double const period = (double)cfg->clk_divisor / cfg->clk_freq_hz;
+	outbuf_printf(ob, "# %u hits in %u samples\n", num_hits, num_samples);
+	if(cfg->truncated_from) {
+		outbuf_printf(ob, "# Truncated capture: %u of %u samples received\n",
+			num_samples, cfg->truncated_from);
+	}
+	for(uint32_t h = 0; h < num_hits; h += 1) {
+		double const t = ((double)hits[h].start - (double)cfg->before_trig) * period;
+		char at[32];
+		fmt_si(at, sizeof(at), t < 0.0? -t : t, "s");
+		outbuf_printf(ob, "%u-%u %c%s\n", hits[h].start, hits[h].end, t < 0.0? '-' : '+', at);
+	}
+}
+
+/* Samples [first, last) around one or more hits, all values written at the
+ * first and (VCD) going to x after the last */
+static void write_find_window(struct outbuf* ob, struct cfg const* cfg, struct vcd_writer const* vw,
+	uint32_t const* values, uint32_t num_samples, uint32_t first, uint32_t last, struct changes* chg)
+{
+	/* A chunk at a time, as that's what the change list has room for */
+	for(uint32_t from = first; from < last; from += READOUT_CHUNK_SAMPLES) {
+		uint32_t const to = last - from > READOUT_CHUNK_SAMPLES? from + READOUT_CHUNK_SAMPLES : last;
+		chg->count = 0;
+		for(uint32_t i = from; i < to; i += 1) {
+			uint32_t const changed = i == first? ~0u : values[i] ^ values[i - 1];
+			if(changed) {
+				chg->index[chg->count] = i;
+				chg->mask[chg->count] = changed;
+				chg->value[chg->count] = values[i];
+				chg->count += 1;
+			}
+		}
+		if(vw) {
+			if(to == num_samples && (chg->count == 0 || chg->index[chg->count - 1] != num_samples - 1)) {
+				chg->index[chg->count] = num_samples - 1;
+				chg->mask[chg->count] = 0;
+				chg->value[chg->count] = values[num_samples - 1];
+				chg->count += 1;
+			}
+			write_vcd_changes(ob, vw, num_samples, chg);
+		}
+		else {
+			write_hex_changes(ob, cfg, from, to, values[from], chg);
+		}
+	}
+	if(vw && last < num_samples) {
+		outbuf_printf(ob, "#%llu\n", (unsigned long long)((double)last * vw->ts.period));
+		write_vcd_unknowns(ob, vw);
+	}
+}
+
+static bool write_find_results(struct readout* ro, struct cfg const* cfg, struct vcd_writer const* vw,
+	struct output* out, uint32_t num_samples)
+{
+	if(!readout_wait(ro, (size_t)num_samples * cfg->num_groups_enabled)) {
+		return false;
+	}
+	assemble_fn const assemble = select_assemble_kernel(cfg->simd);
+	uint32_t* values = malloc((size_t)num_samples * sizeof(uint32_t));
+	struct changes chg = {
+		.index = malloc((READOUT_CHUNK_SAMPLES + 1) * sizeof(uint64_t)),
+		.mask = malloc((READOUT_CHUNK_SAMPLES + 1) * sizeof(uint32_t)),
+		.value = malloc((READOUT_CHUNK_SAMPLES + 1) * sizeof(uint32_t)),
+	};
+	assert((num_samples == 0 || values) && chg.index && chg.mask && chg.value);
+	uint32_t prev = num_samples? sample_at(cfg, ro->buf, num_samples, 0) : 0;
+	for(uint32_t first = 0; first < num_samples; first += READOUT_CHUNK_SAMPLES) {
+		uint32_t const last = num_samples - first > READOUT_CHUNK_SAMPLES? first + READOUT_CHUNK_SAMPLES : num_samples;
+		chg.count = 0;
+		assemble(cfg->num_groups_enabled, ro->buf, num_samples, first, last, prev, values, &chg);
+		prev = values[last - 1];
+	}
+
+	struct find_hit* hits;
+	uint32_t const num_hits = find_hits(cfg, values, num_samples, &hits);
+	if(cfg->verbosity) {
+		fprintf(stderr, "Found %u hits\n", num_hits);
+	}
+
+	struct outbuf ob = { .data = NULL };
+	if(!cfg->find.window) {
+		write_find_report(&ob, cfg, hits, num_hits, num_samples);
+	}
+	else {
+		if(vw) {
+			write_vcd_header(&ob, vw);
+		}
+		else if(cfg->truncated_from) {
+			outbuf_printf(&ob, "# Truncated capture: %u of %u samples received\n",
+				num_samples, cfg->truncated_from);
+		}
+		/* Windows are merged where they overlap or touch */
+		uint32_t h = 0;
+		while(h < num_hits) {
+			uint32_t const first = hits[h].start > cfg->find.before? hits[h].start - cfg->find.before : 0;
+			uint64_t last = (uint64_t)hits[h].end + 1 + cfg->find.after;
+			uint32_t const first_hit = h;
+			for(h += 1; h < num_hits && (uint64_t)hits[h].start <= last + cfg->find.before; h += 1) {
+				last = (uint64_t)hits[h].end + 1 + cfg->find.after;
+			}
+			if(last > num_samples) {
+				last = num_samples;
+			}
+			for(uint32_t k = first_hit; k < h; k += 1) {
+				if(vw) {
+					outbuf_printf(&ob, "$comment\n   Hit at sample %u-%u\n$end\n", hits[k].start, hits[k].end);
+				}
+				else {
+					outbuf_printf(&ob, "# Hit at sample %u-%u\n", hits[k].start, hits[k].end);
+				}
+			}
+			if(!vw) {
+				outbuf_printf(&ob, "# Samples %u-%llu\n", first, (unsigned long long)last - 1);
+			}
+			write_find_window(&ob, cfg, vw, values, num_samples, first, last, &chg);
+		}
+	}
+	output_write(out, ob.data, ob.len);
+	outbuf_free(&ob);
+
+	free(hits);
+	free(values);
+	free(chg.index);
+	free(chg.mask);
+	free(chg.value);
+	return true;
+}
+
+/* Protocol decoders: each one follows its signals through the sample changes
+ * only (the RLE runs, or the change lists from assembly), so idle stretches
+ * cost nothing. UART bit centres are worked out from the start bit edge and
+ * the baud rate rather than looked for sample by sample. Decoded frames are
+ * listed with their start times, or added to the VCD as string values.
+ */
+struct decode_event {
+	uint64_t t; /* Sample the frame started at */
+	char text[48];
+};
+
+struct decoder {
+	struct decoder_cfg const* dc;
+	uint32_t mask; /* All of its signals */
+	uint32_t level; /* Sample value (masked) as of the last change */
+
+	/* Frame in progress */
+	bool active;
+	unsigned bit;
+	uint32_t data, data2;
+	uint64_t t_start;
+	double t_next, spb; /* UART: next bit centre, samples per bit */
+	bool addr_next; /* I2C: the next byte is an address */
+
+	struct decode_event* events;
+	uint32_t num_events, alloced;
+};
+
+static void decode_event(struct decoder* dec, uint64_t t, char const* fmt, ...)
+	__attribute__((format(printf, 3, 4)));
+
+static void decode_event(struct decoder* dec, uint64_t t, char const* fmt, ...)
+{
+	if(dec->num_events == dec->alloced) {
+		dec->alloced = dec->alloced? dec->alloced * 2 : 256;
+		dec->events = realloc(dec->events, dec->alloced * sizeof(struct decode_event));
+		assert(dec->events);
+	}
+	struct decode_event* ev = &dec->events[dec->num_events++];
+	ev->t = t;
+	va_list ap;
+	va_start(ap, fmt);
+	vsnprintf(ev->text, sizeof(ev->text), fmt, ap);
+	va_end(ap);
+}
+
+static void decoder_init(struct decoder* dec, struct decoder_cfg const* dc, struct cfg const* cfg,
+	uint32_t first)
+{
+	memset(dec, 0, sizeof(*dec));
+	dec->dc = dc;
+	for(unsigned s = 0; s < DECODE_SIGNALS; s += 1) {
+		dec->mask |= dc->signals[s];
+	}
+	dec->level = first & dec->mask;
+	dec->spb = dc->proto == DECODE_UART? (double)cfg->clk_freq_hz / cfg->clk_divisor / dc->baud : 0.0;
+}
+
+/* Sample the bit centred at t_next, the line having been at level since the
+ * last change */
+static void uart_bit(struct decoder* dec, bool level)
+{
+	struct decoder_cfg const* dc = dec->dc;
+	unsigned const parity_bit = dc->parity? 1 : 0;
+	if(dec->bit == 0) {
+		/* Start bit, gone high again means a glitch */
+		dec->active = !level;
+	}
+	else if(dec->bit <= dc->bits) {
+		dec->data |= (uint32_t)level << (dec->bit - 1);
+	}
+	else if(dec->bit <= dc->bits + parity_bit) {
+		dec->data2 = level;
+	}
+	else {
+		char c[8] = "";
+		if(dec->data >= 0x20 && dec->data < 0x7F) {
+			snprintf(c, sizeof(c), " '%c'", dec->data);
+		}
+		bool const parity_ok = !dc->parity ||
+			((__builtin_popcount(dec->data) + dec->data2) & 1) == (dc->parity == 'o');
+		decode_event(dec, dec->t_start, "0x%02X%s%s%s", dec->data, c,
+			parity_ok? "" : " parity error", level? "" : " framing error");
+		dec->active = false;
+	}
+	dec->bit += 1;
+	dec->t_next += dec->spb;
+}
+
+/* The decoder's signals are changing to value at sample t */
+static void decode_change(struct decoder* dec, uint64_t t, uint32_t value)
+{
+	struct decoder_cfg const* dc = dec->dc;
+	uint32_t const old = dec->level;
+	uint32_t const cur = value & dec->mask;
+	uint32_t const changed = old ^ cur;
+	dec->level = cur;
+
+	switch(dc->proto) {
+		case DECODE_UART: {
+			uint32_t const rx = dc->signals[0];
+			while(dec->active && dec->t_next < (double)t) {
+				uart_bit(dec, old & rx);
+			}
+			if(!dec->active && (changed & rx) && !(cur & rx)) {
+				dec->active = true;
+				dec->bit = 0;
+				dec->data = 0;
+				dec->t_start = t;
+				dec->t_next = (double)t + dec->spb / 2.0;
+			}
+			break;
+		}
+		case DECODE_SPI: {
+			uint32_t const clk = dc->signals[0], mosi = dc->signals[1], miso = dc->signals[2], cs = dc->signals[3];
+			if(cs && (changed & cs)) {
+				if((cur & cs) && dec->bit && miso) {
+					decode_event(dec, dec->t_start, "mosi 0x%02X miso 0x%02X (%u bits)",
+						dec->data, dec->data2, dec->bit);
+				}
+				else if((cur & cs) && dec->bit) {
+					decode_event(dec, dec->t_start, "0x%02X (%u bits)", dec->data, dec->bit);
+				}
+				dec->bit = 0;
+			}
+			/* Data is taken on the rising edge in modes 0 and 3 */
+			bool const rising = ((dc->mode >> 1) ^ dc->mode ^ 1) & 1;
+			if((changed & clk) && !!(cur & clk) == rising && !(cs && (cur & cs))) {
+				if(dec->bit == 0) {
+					dec->t_start = t;
+					dec->data = dec->data2 = 0;
+				}
+				dec->data = (dec->data << 1) | !!(cur & mosi);
+				dec->data2 = (dec->data2 << 1) | !!(cur & miso);
+				dec->bit += 1;
+				if(dec->bit == dc->bits) {
+					if(miso) {
+						decode_event(dec, dec->t_start, "mosi 0x%02X miso 0x%02X", dec->data, dec->data2);
+					}
+					else {
+						decode_event(dec, dec->t_start, "0x%02X", dec->data);
+					}
+					dec->bit = 0;
+				}
+			}
+			break;
+		}
+		case DECODE_I2C: {
+			uint32_t const scl = dc->signals[0], sda = dc->signals[1];
+			if((old & scl) && (cur & scl) && (changed & sda)) {
+				if(cur & sda) {
+					decode_event(dec, t, "stop");
+					dec->active = false;
+				}
+				else {
+					decode_event(dec, t, dec->active? "restart" : "start");
+					dec->active = true;
+				}
+				dec->bit = 0;
+				dec->addr_next = true;
+			}
+			else if(dec->active && (changed & scl) && (cur & scl)) {
+				if(dec->bit == 0) {
+					dec->t_start = t;
+					dec->data = 0;
+				}
+				if(dec->bit < 8) {
+					dec->data = (dec->data << 1) | !!(cur & sda);
+					dec->bit += 1;
+				}
+				else {
+					char const* ack = (cur & sda)? "nak" : "ack";
+					if(dec->addr_next) {
+						decode_event(dec, dec->t_start, "addr 0x%02X %s %s", dec->data >> 1,
+							(dec->data & 1)? "read" : "write", ack);
+					}
+					else {
+						decode_event(dec, dec->t_start, "0x%02X %s", dec->data, ack);
+					}
+					dec->addr_next = false;
+					dec->bit = 0;
+				}
+			}
+			break;
+		}
+	}
+}
+
+/* End of the capture at sample t */
+static void decode_finish(struct decoder* dec, uint64_t t)
+{
+	if(dec->dc->proto == DECODE_UART) {
+		while(dec->active && dec->t_next < (double)t) {
+			uart_bit(dec, dec->level & dec->dc->signals[0]);
+		}
+	}
+}
+
+static void decode_changes(struct decoder* decs, unsigned num_decs, struct changes const* chg)
+{
+	for(uint32_t c = 0; c < chg->count; c += 1) {
+		for(unsigned d = 0; d < num_decs; d += 1) {
+			if(chg->mask[c] & decs[d].mask) {
+				decode_change(&decs[d], chg->index[c], chg->value[c]);
+			}
+		}
+	}
+}
+
+/* Next event in time over all the decoders, or -1 */
+static int next_decode_event(struct decoder const* decs, unsigned num_decs, uint32_t const* pos)
+{
+	int next = -1;
+	for(unsigned d = 0; d < num_decs; d += 1) {
+		if(pos[d] < decs[d].num_events && (next == -1 ||
+			decs[d].events[pos[d]].t < decs[next].events[pos[next]].t)) {
+			next = d;
+		}
+	}
+	return next;
+}
+
+static void write_decode_report(struct outbuf* ob, struct cfg const* cfg, struct decoder const* decs,
+	uint64_t total)
+{
+	double const period = (double)cfg->clk_divisor / cfg->clk_freq_hz;
+	unsigned const num_decs = cfg->decode.num_decoders;
+	uint32_t pos[MAX_DECODERS] = { 0 };
+	outbuf_printf(ob, "# %llu samples\n", (unsigned long long)total);
+	if(cfg->truncated_from) {
+		outbuf_printf(ob, "# Truncated capture: %llu of %u samples received\n",
+			(unsigned long long)total, cfg->truncated_from);
+	}
+	int d;
+	while((d = next_decode_event(decs, num_decs, pos)) != -1) {
+		struct decode_event const* ev = &decs[d].events[pos[d]++];
+		double const t = ((double)ev->t - (double)cfg->before_trig) * period;
+		char at[32];
+		fmt_si(at, sizeof(at), t < 0.0? -t : t, "s");
+		outbuf_printf(ob, "%llu %c%s %s: %s\n", (unsigned long long)ev->t, t < 0.0? '-' : '+', at,
+			decs[d].dc->name, ev->text);
+	}
+}
+
+/* VCD with each decoder as a string value after the vcd values, written in
+ * one pass over the assembled samples with the frames merged in by time */
+static void write_decoded_vcd(struct outbuf* ob, struct vcd_writer const* vw, struct decoder const* decs,
+	uint32_t const* values, uint32_t num_samples, struct changes* chg)
+{
+	struct cfg const* cfg = vw->cfg;
+	unsigned const num_decs = cfg->decode.num_decoders;
+	uint32_t vcd_mask = 0;
+	for(unsigned vali = 0; vali < cfg->vcd.num_values; vali += 1) {
+		vcd_mask |= vw->values[vali].mask;
+	}
+	uint32_t pos[MAX_DECODERS] = { 0 };
+	int d = next_decode_event(decs, num_decs, pos);
+
+	write_vcd_header(ob, vw);
+	for(uint32_t first = 0; first < num_samples; first += READOUT_CHUNK_SAMPLES) {
+		uint32_t const last = num_samples - first > READOUT_CHUNK_SAMPLES? first + READOUT_CHUNK_SAMPLES : num_samples;
+		chg->count = 0;
+		for(uint32_t i = first; i < last; i += 1) {
+			/* The header has everything at 0 to start with */
+			uint32_t const changed = values[i] ^ (i > 0? values[i - 1] : 0);
+			if(changed || i == num_samples - 1) {
+				chg->index[chg->count] = i;
+				chg->mask[chg->count] = changed;
+				chg->value[chg->count] = values[i];
+				chg->count += 1;
+			}
+		}
+
+		/* Up to and including each frame's start, then the frame */
+		uint32_t c = 0;
+		while(d != -1 && decs[d].events[pos[d]].t < last) {
+			uint64_t const t = decs[d].events[pos[d]].t;
+			uint32_t n = c;
+			while(n < chg->count && chg->index[n] <= t) {
+				n += 1;
+			}
+			struct changes part = {
+				.index = &chg->index[c], .mask = &chg->mask[c], .value = &chg->value[c], .count = n - c,
+			};
+			write_vcd_changes(ob, vw, num_samples, &part);
+			bool const have_time = n > c && chg->index[n - 1] == t &&
+				((chg->mask[n - 1] & vcd_mask) || t == num_samples - 1);
+			if(!have_time) {
+				outbuf_printf(ob, "#%llu\n", (unsigned long long)((double)t * vw->ts.period));
+			}
+			c = n;
+			do {
+				/* No spaces allowed in the value */
+				char text[sizeof(decs[d].events[pos[d]].text)];
+				strcpy(text, decs[d].events[pos[d]].text);
+				for(char* p = text; *p; p += 1) {
+					*p = *p == ' '? '_' : *p;
+				}
+				char id[4];
+				unsigned const id_len = vcd_id(id, cfg->vcd.num_values + d);
+				outbuf_printf(ob, "s%s %.*s\n", text, id_len, id);
+				pos[d] += 1;
+				d = next_decode_event(decs, num_decs, pos);
+			}
+			while(d != -1 && decs[d].events[pos[d]].t == t);
+		}
+		struct changes rest = {
+			.index = &chg->index[c], .mask = &chg->mask[c], .value = &chg->value[c], .count = chg->count - c,
+		};
+		write_vcd_changes(ob, vw, num_samples, &rest);
+	}
+}
+
+static bool write_decoded(struct readout* ro, struct cfg const* cfg, struct vcd_writer const* vw,
+	struct output* out, uint32_t num_samples)
+{
+	unsigned const num_decs = cfg->decode.num_decoders;
+	struct decoder decs[MAX_DECODERS];
+	uint64_t total = 0;
+	uint32_t* values = NULL;
+	struct rle_runs runs;
+	if(cfg->rle? !rle_read_runs(ro, cfg, num_samples, &runs, &total) :
+		!readout_wait(ro, (size_t)num_samples * cfg->num_groups_enabled)) {
+		return false;
+	}
+	struct changes chg = {
+		.index = malloc((READOUT_CHUNK_SAMPLES + 1) * sizeof(uint64_t)),
+		.mask = malloc((READOUT_CHUNK_SAMPLES + 1) * sizeof(uint32_t)),
+		.value = malloc((READOUT_CHUNK_SAMPLES + 1) * sizeof(uint32_t)),
+	};
+	assert(chg.index && chg.mask && chg.value);
+
+	if(cfg->rle) {
+		/* Runs are newest first */
+		for(unsigned d = 0; d < num_decs; d += 1) {
+			decoder_init(&decs[d], &cfg->decode.decoders[d], cfg, runs.count? runs.value[runs.count - 1] : 0);
+		}
+		uint64_t t = 0;
+		for(uint32_t r = runs.count; r > 0; r -= 1) {
+			for(unsigned d = 0; d < num_decs; d += 1) {
+				if((runs.value[r - 1] & decs[d].mask) != decs[d].level) {
+					decode_change(&decs[d], t, runs.value[r - 1]);
+				}
+			}
+			t += runs.length[r - 1];
+		}
+		free(runs.value);
+		free(runs.length);
+	}
+	else {
+		total = num_samples;
+		assemble_fn const assemble = select_assemble_kernel(cfg->simd);
+		values = malloc((size_t)num_samples * sizeof(uint32_t));
+		assert(num_samples == 0 || values);
+		uint32_t prev = num_samples? sample_at(cfg, ro->buf, num_samples, 0) : 0;
+		for(unsigned d = 0; d < num_decs; d += 1) {
+			decoder_init(&decs[d], &cfg->decode.decoders[d], cfg, prev);
+		}
+		for(uint32_t first = 0; first < num_samples; first += READOUT_CHUNK_SAMPLES) {
+			uint32_t const last = num_samples - first > READOUT_CHUNK_SAMPLES? first + READOUT_CHUNK_SAMPLES : num_samples;
+			chg.count = 0;
+			assemble(cfg->num_groups_enabled, ro->buf, num_samples, first, last, prev, values, &chg);
+			decode_changes(decs, num_decs, &chg);
+			prev = values[last - 1];
+		}
+	}
+	for(unsigned d = 0; d < num_decs; d += 1) {
+		decode_finish(&decs[d], total);
+		if(cfg->verbosity) {
+			fprintf(stderr, "%s: %u frames\n", decs[d].dc->name, decs[d].num_events);
+		}
+	}
+
+	struct outbuf ob = { .data = NULL };
+	if(vw) {
+		write_decoded_vcd(&ob, vw, decs, values, num_samples, &chg);
+	}
+	else {
+		write_decode_report(&ob, cfg, decs, total);
+	}
+	output_write(out, ob.data, ob.len);
+	outbuf_free(&ob);
+
+	for(unsigned d = 0; d < num_decs; d += 1) {
+		free(decs[d].events);
+	}
+	free(values);
+	free(chg.index);
+	free(chg.mask);
+	free(chg.value);
+	return true;
+}
+
+/* Write the samples in the selected format as they arrive */
+static bool format_samples(struct readout* ro, struct cfg const* cfg, struct output* out,
+	uint32_t num_samples)
+{
+	if(cfg->segment && !segment_place(ro, cfg, num_samples)) {
+		return false;
+	}
+
+	struct vcd_writer* vw = NULL;
+	if(cfg->vcd.num_values && !cfg->raw && !cfg->capfile && !cfg->compress && !cfg->measure
+		&& (cfg->find.num_steps == 0 || cfg->find.window)) {
+		vw = malloc(sizeof(struct vcd_writer));
+		assert(vw);
+		vcd_writer_init(vw, cfg, 0);
+		vw->sample_offset = cfg->segment? cfg->segment->offset : 0;
+	}
+
+	/* Raw RLE output is just the words as sent */
+	bool complete;
+	if(cfg->measure) {
+		complete = write_measurements(ro, cfg, out, num_samples);
+	}
+	else if(cfg->find.num_steps) {
+		complete = write_find_results(ro, cfg, vw, out, num_samples);
+	}
+	else if(cfg->decode.num_decoders) {
+		complete = write_decoded(ro, cfg, vw, out, num_samples);
+	}
+	else if(cfg->rle && !cfg->raw) {
+		complete = write_rle_runs(ro, cfg, vw, out, num_samples);
+	}
+	else {
+		complete = write_chunked_samples(ro, cfg, vw, out, num_samples);
+	}
+
+	if(complete && cfg->segment) {
+		struct segment_state* seg = cfg->segment;
+		double const period = (double)cfg->clk_divisor / cfg->clk_freq_hz;
+		seg->last_value = num_samples? sample_at(cfg, ro->buf, num_samples, num_samples - 1) : 0;
+		seg->next = seg->offset + num_samples + 1;
+		seg->t_end = seg->t_origin + (seg->offset + num_samples) * period;
+		seg->index += 1;
+	}
+
+	if(vw) {
+		vcd_writer_free(vw);
+	}
+	free(vw);
+	return complete;
+}
+
+struct capture_timing {
+	double t_begin, t_config, t_run, t_first, t_last, t_done;
+	double t_rearm; /* When the next capture was started, if it was */
+
+	/* Readout and output stats, see struct readout */
+	size_t read_bytes, first_bytes;
+	uint32_t read_calls;
+	uint32_t read_sizes[32];
+	double t_wait;
+	uint64_t output_bytes;
+	bool truncated; /* Readout timed out */
+};
+
+static void read_and_write_samples(struct transport* tp, struct cfg const* cfg, struct output* out,
+	uint32_t num_samples, bool rearm, struct capture_timing* timing)
+{
+	size_t const capture_bytes = (size_t)num_samples * cfg->num_groups_enabled;
+
+	/* Demuxed data is formatted as twice as many half width samples at twice
+	 * the rate */
+	struct cfg demux_cfg;
+	if(cfg->demux) {
+		demux_cfg = *cfg;
+		demux_cfg.group_enable &= 0x3;
+		demux_cfg.num_groups_enabled /= 2;
+		demux_cfg.samples *= 2;
+		demux_cfg.before_trig *= 2;
+		demux_cfg.clk_freq_hz *= 2;
+		cfg = &demux_cfg;
+		num_samples *= 2;
+	}
+
+	/* Raw and capfile samples can go straight into the output file, with
+	 * no buffer in between */
+	size_t const word_bytes = cfg->demux? cfg->num_groups_enabled * 2 : cfg->num_groups_enabled;
+	size_t const samples_offset = cfg->capfile? capfile_align(capfile_header_bytes(cfg)) : 0;
+	size_t const file_bytes = cfg->capfile? capfile_bytes(cfg, num_samples) : capture_bytes;
+	struct output_map map = { .addr = NULL };
+	bool const mapped = (cfg->raw || cfg->capfile) && output_map(out, file_bytes, &map);
+
+	struct readout ro = {
+		.tp = tp,
+		.demux_half = cfg->demux? cfg->num_groups_enabled : 0,
+		.demux = cfg->demux? select_demux_kernel(cfg->simd) : NULL,
+		.map = mapped? map.data + samples_offset : NULL,
+		.map_chunk = READOUT_CHUNK_SAMPLES * word_bytes,
+		.sample_bytes = cfg->num_groups_enabled,
+		.buf = mapped? NULL : malloc(capture_bytes),
+		.bytes = capture_bytes,
+		.pos = 0,
+		.rearm = rearm,
+		.trigger_timeout = cfg->trigger_timeout,
+		.stall_timeout = cfg->stall_timeout,
+		.progress = cfg->progress,
+		.t_run = timing->t_run,
+	};
+	assert(ro.buf || ro.map);
+	pthread_mutex_init(&ro.lock, NULL);
+	pthread_cond_init(&ro.cond, NULL);
+
+	pthread_t reader;
+	if(pthread_create(&reader, NULL, readout_thread, &ro) != 0) {
+		perror_exit("Error creating readout thread");
+	}
+
+	bool complete;
+	if(mapped) {
+		complete = readout_wait(&ro, capture_bytes);
+		if(complete && cfg->capfile) {
+			write_mapped_capfile(map.data, cfg, num_samples);
+		}
+	}
+	else {
+		complete = format_samples(&ro, cfg, out, num_samples);
+	}
+
+	pthread_join(reader, NULL);
+	timing->truncated = !complete;
+	if(!complete) {
+		fprintf(stderr, "%s after %zu of %zu bytes\n",
+			ro.received? "Readout stalled" : "Timed out waiting for trigger", ro.received, capture_bytes);
+	}
+	if(mapped && !complete && cfg->salvage) {
+		ro.buf = unmap_readout(&ro, word_bytes);
+	}
+	if(mapped) {
+		output_unmap(out, &map, complete? file_bytes : 0);
+	}
+	if(!complete && cfg->salvage) {
+		/* The samples that did arrive are the newest ones, which is all a
+		 * shorter capture would have sent */
+		uint32_t const got = ro.pos / cfg->num_groups_enabled;
+		uint32_t const lost = num_samples - got;
+		struct cfg trunc = *cfg;
+		trunc.truncated_from = num_samples;
+		trunc.samples = got;
+		trunc.before_trig = cfg->before_trig > lost? cfg->before_trig - lost : 0;
+		ro.bytes = (size_t)got * cfg->num_groups_enabled;
+		ro.timed_out = false;
+		format_samples(&ro, &trunc, out, got);
+		fprintf(stderr, "Wrote truncated capture of %u samples\n", got);
+	}
+
+	timing->t_first = ro.t_first;
+	timing->t_last = ro.t_last;
+	timing->t_rearm = ro.t_rearm;
+	timing->read_bytes = ro.received;
+	timing->first_bytes = ro.first_bytes;
+	timing->read_calls = ro.read_calls;
+	memcpy(timing->read_sizes, ro.read_sizes, sizeof(ro.read_sizes));
+	timing->t_wait = ro.t_wait;
+
+	double const t_read = ro.t_last - ro.t_first;
+	if(t_read > 0.0 && cfg->verbosity) {
+		size_t const timed_bytes = ro.received - ro.first_bytes;
+		fprintf(stderr, "Read %zu bytes in %.3lfs: %.0lf bytes/s (%.0lf baud effective, link %u baud)\n",
+			ro.received, t_read, (double)timed_bytes / t_read,
+			(double)timed_bytes * 10.0 / t_read, cfg->baud);
+	}
+
+	pthread_cond_destroy(&ro.cond);
+	pthread_mutex_destroy(&ro.lock);
+	free(ro.buf);
+}
+
+/* Last value sent for each command, so that repeated captures only need to
+ * send what has changed */
+struct cmd_cache {
+	bool valid[256];
+	uint8_t data[256][4];
+};
+
+static void send_cached(struct transport* tp, struct cmd_cache* cache, struct cmd const* cmd)
+{
+	if(cmd->len == 5) {
+		uint8_t const op = cmd->data[0];
+		if(cache->valid[op] && memcmp(cache->data[op], &cmd->data[1], 4) == 0) {
+			return;
+		}
+		cache->valid[op] = true;
+		memcpy(cache->data[op], &cmd->data[1], 4);
+	}
+	transport_send(tp, cmd);
+}
+
+/* State of the device across captures */
+struct device {
+	struct transport tp;
+	struct cmd_cache cache;
+	bool configured;
+	bool armed; /* Run already sent for the next capture */
+	double t_armed;
+};
+
+/* Send the capture configuration, only what changed since the last capture */
+static void configure(struct device* dev, struct cfg const* cfg)
+{
+	struct transport* const tp = &dev->tp;
+	uint32_t group_dis = ~cfg->group_enable & cfg->group_mask;
+
+	if(!dev->configured) {
+		/* Reset (5 times as spec-ed */
+		for(unsigned i = 0; i < 5; i += 1) {
+			transport_send(tp, &cmd_reset);
+		}
+		memset(&dev->cache, 0, sizeof(dev->cache));
+		dev->configured = true;
+	}
+
+	struct cmd cmd;
+
+	cmd_divider(&cmd, cfg->clk_divisor - 1);
+	send_cached(tp, &dev->cache, &cmd);
+
+	if(cfg->num_stages) {
+		for(unsigned i = 0; i < MAX_TRIGGER_STAGES; i += 1) {
+			struct trigger_stage const* ts = &cfg->stages[i];
+			if(i < cfg->num_stages) {
+				cmd_trig_mask(&cmd, i, ts->mask);
+				send_cached(tp, &dev->cache, &cmd);
+				cmd_trig_value(&cmd, i, ts->value);
+				send_cached(tp, &dev->cache, &cmd);
+				cmd_trig_cfg(&cmd, i, ts->delay, ts->level, ts->channel, ts->serial, ts->start);
+				send_cached(tp, &dev->cache, &cmd);
+			}
+			else {
+				cmd_trig_mask(&cmd, i, 0);
+				send_cached(tp, &dev->cache, &cmd);
+				cmd_trig_value(&cmd, i, 0);
+				send_cached(tp, &dev->cache, &cmd);
+				cmd_trig_cfg(&cmd, i, 0, 3, 0, false, false);
+				send_cached(tp, &dev->cache, &cmd);
+			}
+		}
+	}
+	else if(cfg->trigger_mask == 0) {
+		cmd_trig_mask(&cmd, 0, 0);
+		send_cached(tp, &dev->cache, &cmd);
+
+		cmd_trig_value(&cmd, 0, 0);
+		send_cached(tp, &dev->cache, &cmd);
+
+		cmd_trig_cfg(&cmd, 0, 0, 0, 0, false, true);
+		send_cached(tp, &dev->cache, &cmd);
+	}
+	else {
+		cmd_trig_mask(&cmd, 0, cfg->trigger_mask);
+		send_cached(tp, &dev->cache, &cmd);
+		cmd_trig_value(&cmd, 0, cfg->trigger_value);
+		send_cached(tp, &dev->cache, &cmd);
+		cmd_trig_cfg(&cmd, 0, 0, 0, 0, false, true);
+		send_cached(tp, &dev->cache, &cmd);
+
+		for(unsigned i = 1; i < 4; i += 1) {
+			cmd_trig_mask(&cmd, i, 0);
+			send_cached(tp, &dev->cache, &cmd);
+			cmd_trig_value(&cmd, i, 0);
+			send_cached(tp, &dev->cache, &cmd);
+			cmd_trig_cfg(&cmd, i, 0, 3, 0, false, false);
+			send_cached(tp, &dev->cache, &cmd);
+		}
+	}
+
+	cmd_counts(&cmd, cfg->samples / 4, (cfg->samples - cfg->before_trig) / 4);
+	send_cached(tp, &dev->cache, &cmd);
+
+	cmd_flags(&cmd, group_dis, cfg->demux, false, false, false, cfg->rle);
+	send_cached(tp, &dev->cache, &cmd);
+}
+
+static void arm(struct device* dev, struct capture_timing* timing)
+{
+	if(dev->armed) {
+		timing->t_run = dev->t_armed;
+	}
+	else {
+		/* Sends the queued configuration too */
+		transport_send(&dev->tp, &cmd_run);
+		transport_flush(&dev->tp);
+		timing->t_run = monotonic_time();
+	}
+}
+
+static void capture_samples(struct device* dev, struct cfg const* cfg, struct output* out,
+	bool rearm, struct capture_timing* timing)
+{
+	timing->t_begin = monotonic_time();
+	configure(dev, cfg);
+	timing->t_config = monotonic_time();
+	arm(dev, timing);
+	read_and_write_samples(&dev->tp, cfg, out, cfg->samples, rearm, timing);
+	timing->t_done = monotonic_time();
+	timing->output_bytes = out->bytes;
+
+	dev->armed = rearm;
+	dev->t_armed = timing->t_rearm;
+}
+
+static void capture(struct device* dev, struct cfg const* cfg, struct output* out,
+	uint32_t index, bool rearm, struct capture_timing* timing)
+{
+	output_begin(out, index);
+	capture_samples(dev, cfg, out, rearm, timing);
+	output_end(out, index);
+	timing->t_done = monotonic_time();
+}
+
+static char const* backend_name(struct cfg const* cfg)
+{
+	if(cfg->raw) {
+		return "raw";
+	}
+	if(cfg->capfile) {
+		return "capfile";
+	}
+	if(cfg->vcd.num_values) {
+		return cfg->rle? "rle-vcd" : "vcd";
+	}
+	return cfg->rle? "rle-hex" : "hex";
+}
+
+/* One JSON object (on one line) per capture. Times are in seconds; setup is
+ * opening and configuring the tty, ident the reset/ident/metadata exchange,
+ * config the capture commands, trigger_wait from run to the first byte,
+ * readout from there to the last byte and output from there until all output
+ * is written. format_busy is the time spent formatting, i.e. from the first
+ * byte to the end of output without the time spent waiting for data. Read
+ * sizes are counted in power of two ranges, keyed by the bottom of the range. */
+static void write_stats_json(FILE* f, struct cfg const* cfg, uint32_t index,
+	double t_setup, double t_ident, struct capture_timing const* t)
+{
+	double const t_read = t->t_last - t->t_first;
+	double const read_rate = t_read > 0.0? (double)(t->read_bytes - t->first_bytes) / t_read : 0.0;
+	double const t_format = (t->t_done - t->t_first) - t->t_wait;
+
+	fprintf(f, "{\"capture\":%u,\"backend\":\"%s\",\"truncated\":%s,\"samples\":%u,\"groups\":%u,\"divisor\":%u,\"baud\":%u,",
+		index, backend_name(cfg), t->truncated? "true" : "false", cfg->demux? cfg->samples * 2 : cfg->samples, cfg->num_groups_enabled, cfg->clk_divisor, cfg->baud);
+	fprintf(f, "\"phases\":{\"setup\":%.6f,\"ident\":%.6f,\"config\":%.6f,\"trigger_wait\":%.6f,"
+		"\"readout\":%.6f,\"output\":%.6f,\"capture_total\":%.6f},",
+		t_setup, t_ident, t->t_config - t->t_begin, t->t_first - t->t_run,
+		t_read, t->t_done - t->t_last, t->t_done - t->t_begin);
+
+	fprintf(f, "\"read\":{\"bytes\":%zu,\"calls\":%u,\"mean_size\":%.1f,\"sizes\":{",
+		t->read_bytes, t->read_calls, t->read_calls? (double)t->read_bytes / t->read_calls : 0.0);
+	bool first = true;
+	for(unsigned b = 0; b < 32; b += 1) {
+		if(t->read_sizes[b]) {
+			fprintf(f, "%s\"%u\":%u", first? "" : ",", 1u << b, t->read_sizes[b]);
+			first = false;
+		}
+	}
+	fprintf(f, "},\"bytes_per_s\":%.0f,\"effective_baud\":%.0f},", read_rate, read_rate * 10.0);
+
+	fprintf(f, "\"output\":{\"bytes\":%llu,\"format_busy\":%.6f,\"bytes_per_s\":%.0f}}\n",
+		(unsigned long long)t->output_bytes, t_format,
+		t_format > 0.0? (double)t->output_bytes / t_format : 0.0);
+	fflush(f);
+}
+
+/* Sample bits are packed down to the enabled groups, triggers are on the
+ * device's channels */
+static uint32_t sample_to_channels(struct cfg const* cfg, uint32_t sample)
+{
+	uint32_t v = 0;
+	unsigned byte = 0;
+	for(unsigned g = 0; g < 4; g += 1) {
+		if(cfg->group_enable & cfg->group_mask & (1u << g)) {
+			v |= ((sample >> (byte * 8)) & 0xFF) << (g * 8);
+			byte += 1;
+		}
+	}
+	return v;
+}
+
+/* Take the segments of a segmented capture (see struct segment_state) into
+ * one output. Returns the exit status. */
+static int capture_segments(struct device* dev, struct cfg const* cfg, struct output* out,
+	double t_setup, double t_ident)
+{
+	struct segment_state state = { .index = 0 };
+	struct cfg seg = *cfg;
+	seg.segment = &state;
+
+	/* Triggering on the last state needs the data first */
+	bool const rearm = !cfg->segment_last;
+	uint32_t const trigger_mask = cfg->trigger_mask? cfg->trigger_mask :
+		sample_to_channels(cfg, (uint32_t)(((uint64_t)1 << (cfg->num_groups_enabled * 8)) - 1));
+
+	int status = EXIT_SUCCESS;
+	output_begin(out, 0);
+	for(uint32_t n = 0; n < cfg->segments; n += 1) {
+		struct capture_timing timing = { .t_begin = 0.0 };
+		double const t_prev_end = state.t_end;
+		capture_samples(dev, &seg, out, rearm && n + 1 < cfg->segments, &timing);
+		if(cfg->stats_json) {
+			write_stats_json(stderr, &seg, n, t_setup, t_ident, &timing);
+		}
+		if(timing.truncated) {
+			status = cfg->salvage? 2 : EXIT_FAILURE;
+			break;
+		}
+		if(cfg->verbosity) {
+			double const t_start = state.t_origin + state.offset * ((double)seg.clk_divisor / seg.clk_freq_hz);
+			fprintf(stderr, "Segment %u: %u samples at +%.6lfs", n, seg.samples, t_start - state.t_origin);
+			if(n > 0) {
+				fprintf(stderr, ", gap %.3lfms", (t_start - t_prev_end) * 1e3);
+			}
+			fprintf(stderr, "\n");
+		}
+
+		if(cfg->segment_last) {
+			seg.trigger_mask = trigger_mask;
+			seg.trigger_value = sample_to_channels(cfg, state.last_value) & trigger_mask;
+		}
+	}
+	output_end(out, 0);
+	return status;
+}
+
+/* Several analysers captured together, to get more channels than one has.
+ * All are configured first and then armed back to back, and drained together
+ * with non-blocking reads. The output is one VCD with each device's signals in
+ * its own scope, with the devices lined up on their trigger points. */
+#define MAX_DEVICES 8
+
+struct analyser {
+	char const* path;
+	struct cfg cfg;
+	struct device dev;
+	struct capture_timing timing;
+
+	uint8_t* buf;
+	size_t bytes, pos;
+	double t_activity; /* Run sent or last data, for the timeouts */
+};
+
+static void read_analysers(struct analyser* an, unsigned num_an)
+{
+#ifdef __linux__
+	int const ep = epoll_create1(EPOLL_CLOEXEC);
+	if(ep == -1) {
+		perror_exit("epoll_create1");
+	}
+
+	unsigned remaining = 0;
+	for(unsigned d = 0; d < num_an; d += 1) {
+		an[d].pos = 0;
+		an[d].t_activity = an[d].timing.t_run;
+		if(an[d].bytes == 0) {
+			an[d].timing.t_first = an[d].timing.t_last = monotonic_time();
+			continue;
+		}
+		int const flags = fcntl(an[d].dev.tp.fd, F_GETFL);
+		if(flags == -1 || fcntl(an[d].dev.tp.fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+			perror_exit("Error setting tty non-blocking");
+		}
+		struct epoll_event ev = { .events = EPOLLIN, .data.u32 = d };
+		if(epoll_ctl(ep, EPOLL_CTL_ADD, an[d].dev.tp.fd, &ev) == -1) {
+			perror_exit("epoll_ctl");
+		}
+		remaining += 1;
+	}
+
+	while(remaining) {
+		/* Wake up for the nearest trigger/stall timeout */
+		double const now = monotonic_time();
+		int ms = -1;
+		for(unsigned d = 0; d < num_an; d += 1) {
+			struct analyser const* a = &an[d];
+			double const timeout = a->pos == 0? a->cfg.trigger_timeout : a->cfg.stall_timeout;
+			if(a->pos == a->bytes || timeout <= 0.0) {
+				continue;
+			}
+			double const left = a->t_activity + timeout - now;
+			if(left <= 0.0) {
+				fprintf(stderr, "%s: %s after %zu of %zu bytes\n", a->path,
+					a->pos? "readout stalled" : "timed out waiting for trigger", a->pos, a->bytes);
+				exit(EXIT_FAILURE);
+			}
+			if(ms < 0 || (int)(left * 1e3) + 1 < ms) {
+				ms = (int)(left * 1e3) + 1;
+			}
+		}
+
+		struct epoll_event events[MAX_DEVICES];
+		int const n = epoll_wait(ep, events, MAX_DEVICES, ms);
+		if(n == -1) {
+			if(errno == EINTR) {
+				continue;
+			}
+			perror_exit("epoll_wait");
+		}
+		for(int e = 0; e < n; e += 1) {
+			struct analyser* a = &an[events[e].data.u32];
+			while(a->pos < a->bytes) {
+				ssize_t sz = read(a->dev.tp.fd, &a->buf[a->pos], a->bytes - a->pos);
+				if(sz == -1 && (errno == EAGAIN || errno == EINTR)) {
+					break;
+				}
+				if(sz == -1) {
+					perror_exit("Error reading from tty");
+				}
+				if(sz == 0) {
+					fprintf(stderr, "Error reading from %s: end of file\n", a->path);
+					exit(EXIT_FAILURE);
+				}
+				a->t_activity = monotonic_time();
+				if(a->pos == 0) {
+					a->timing.t_first = a->t_activity;
+				}
+				a->pos += sz;
+			}
+			if(a->pos == a->bytes) {
+				a->timing.t_last = monotonic_time();
+				epoll_ctl(ep, EPOLL_CTL_DEL, a->dev.tp.fd, NULL);
+				int const flags = fcntl(a->dev.tp.fd, F_GETFL);
+				fcntl(a->dev.tp.fd, F_SETFL, flags & ~O_NONBLOCK);
+				remaining -= 1;
+			}
+		}
+	}
+	close(ep);
+#else
+	(void)an;
+	(void)num_an;
+	fprintf(stderr, "Multiple devices not supported on this platform\n");
+	exit(EXIT_FAILURE);
+#endif
+}
+
+/* Per device state for writing the merged VCD */
+struct merge_source {
+	struct vcd_writer vw;
+	struct changes chg;
+	uint64_t num_samples;
+	/* Time of sample i is i * scale + offset, in output timescale units */
+	double scale, offset;
+	uint32_t next;
+};
+
+static void write_merged_vcd(struct output* out, struct analyser* an, unsigned num_an)
+{
+	struct merge_source* src = calloc(num_an, sizeof(struct merge_source));
+	assert(src);
+
+	/* The timescale comes from the fastest device, and the devices are
+	 * shifted so the one with the most time before its trigger starts at 0 */
+	unsigned fastest = 0;
+	for(unsigned d = 1; d < num_an; d += 1) {
+		struct cfg const* c = &an[d].cfg;
+		struct cfg const* f = &an[fastest].cfg;
+		if((double)c->clk_divisor / c->clk_freq_hz < (double)f->clk_divisor / f->clk_freq_hz) {
+			fastest = d;
+		}
+	}
+
+	unsigned id_base = 0;
+	for(unsigned d = 0; d < num_an; d += 1) {
+		vcd_writer_init(&src[d].vw, &an[d].cfg, id_base);
+		id_base += an[d].cfg.vcd.num_values;
+	}
+
+	struct cfg const* const f = &an[fastest].cfg;
+	double pre_trigger = 0.0;
+	for(unsigned d = 0; d < num_an; d += 1) {
+		struct cfg const* cfg = &an[d].cfg;
+		src[d].scale = src[fastest].vw.ts.period *
+			((double)cfg->clk_divisor * f->clk_freq_hz) / ((double)f->clk_divisor * cfg->clk_freq_hz);
+		if((double)cfg->before_trig * src[d].scale > pre_trigger) {
+			pre_trigger = (double)cfg->before_trig * src[d].scale;
+		}
+	}
+
+	for(unsigned d = 0; d < num_an; d += 1) {
+		struct cfg const* cfg = &an[d].cfg;
+		struct merge_source* ms = &src[d];
+		uint32_t const num_samples = cfg->samples;
+		ms->num_samples = num_samples;
+		ms->offset = pre_trigger - (double)cfg->before_trig * ms->scale;
+		ms->next = 0;
+
+		uint32_t* values = malloc(((size_t)num_samples + 1) * sizeof(uint32_t));
+		ms->chg = (struct changes){
+			.index = malloc(((size_t)num_samples + 1) * sizeof(uint64_t)),
+			.mask = malloc(((size_t)num_samples + 1) * sizeof(uint32_t)),
+			.value = malloc(((size_t)num_samples + 1) * sizeof(uint32_t)),
+			.count = 0,
+		};
+		assert(values && ms->chg.index && ms->chg.mask && ms->chg.value);
+		if(num_samples) {
+			select_assemble_kernel(cfg->simd)(cfg->num_groups_enabled, an[d].buf, num_samples,
+				0, num_samples, 0, values, &ms->chg);
+			if(ms->chg.count == 0 || ms->chg.index[ms->chg.count - 1] != num_samples - 1) {
+				ms->chg.index[ms->chg.count] = num_samples - 1;
+				ms->chg.mask[ms->chg.count] = 0;
+				ms->chg.value[ms->chg.count] = values[num_samples - 1];
+				ms->chg.count += 1;
+			}
+		}
+		free(values);
+	}
+
+	struct outbuf ob = { .data = NULL };
+	time_t curtime = time(NULL);
+	outbuf_printf(&ob, "$date\n  %s$end\n", ctime(&curtime));
+	outbuf_printf(&ob, "$version\n   Sump dumper\n$end\n");
+	outbuf_printf(&ob, "$timescale %u%s $end\n", src[fastest].vw.ts.unit_scale, src[fastest].vw.ts.unit);
+	for(unsigned d = 0; d < num_an; d += 1) {
+		char const* name = strrchr(an[d].path, '/');
+		outbuf_printf(&ob, "$scope module %s $end\n", name? name + 1 : an[d].path);
+		write_vcd_vars(&ob, &src[d].vw);
+		outbuf_printf(&ob, "$upscope $end\n");
+	}
+	outbuf_printf(&ob, "$enddefinitions $end\n");
+	outbuf_printf(&ob, "$dumpvars\n");
+	for(unsigned d = 0; d < num_an; d += 1) {
+		for(unsigned vali = 0; vali < an[d].cfg.vcd.num_values; vali += 1) {
+			char* p = outbuf_reserve(&ob, VCD_VALUE_MAX_LEN);
+			ob.len += write_vcd_value(p, &src[d].vw.values[vali], 0, false) - p;
+		}
+	}
+	outbuf_printf(&ob, "$end\n");
+
+	/* Merge the change lists in time order */
+	uint64_t last_time = UINT64_MAX;
+	while(1) {
+		unsigned best = num_an;
+		uint64_t best_time = UINT64_MAX;
+		for(unsigned d = 0; d < num_an; d += 1) {
+			struct merge_source const* ms = &src[d];
+			if(ms->next < ms->chg.count) {
+				uint64_t const t = (uint64_t)((double)ms->chg.index[ms->next] * ms->scale + ms->offset);
+				if(best == num_an || t < best_time) {
+					best = d;
+					best_time = t;
+				}
+			}
+		}
+		if(best == num_an) {
+			break;
+		}
+
+		struct merge_source* ms = &src[best];
+		uint64_t const i = ms->chg.index[ms->next];
+		uint32_t const changed = ms->chg.mask[ms->next];
+		uint32_t const cur = ms->chg.value[ms->next];
+		ms->next += 1;
+
+		char* const start = outbuf_reserve(&ob, 22 + an[best].cfg.vcd.num_values * VCD_VALUE_MAX_LEN);
+		char* p = start;
+		for(uint32_t w = 0; w < ms->vw.num_words; w += 1) {
+			uint64_t vals = i == ms->num_samples - 1? vcd_all_values(&ms->vw, w) : vcd_touched(&ms->vw, w, changed);
+			while(vals) {
+				struct vcd_writer_value const* wv = &ms->vw.values[w * 64 + __builtin_ctzll(vals)];
+				vals &= vals - 1;
+				if(best_time != last_time) {
+					*p++ = '#';
+					p = fmt_u64(p, best_time);
+					*p++ = '\n';
+					last_time = best_time;
+				}
+				p = write_vcd_value(p, wv, cur, false);
+			}
+		}
+		ob.len += p - start;
+
+		if(ob.len >= (1u << 20)) {
+			output_write(out, ob.data, ob.len);
+			ob.len = 0;
+		}
+	}
+	output_write(out, ob.data, ob.len);
+	outbuf_free(&ob);
+
+	for(unsigned d = 0; d < num_an; d += 1) {
+		free(src[d].chg.index);
+		free(src[d].chg.mask);
+		free(src[d].chg.value);
+		vcd_writer_free(&src[d].vw);
+	}
+	free(src);
+}
+
+static void capture_analysers(struct analyser* an, unsigned num_an, struct output* out, uint32_t index)
+{
+	for(unsigned d = 0; d < num_an; d += 1) {
+		configure(&an[d].dev, &an[d].cfg);
+	}
+	for(unsigned d = 0; d < num_an; d += 1) {
+		arm(&an[d].dev, &an[d].timing);
+	}
+
+	read_analysers(an, num_an);
+
+	for(unsigned d = 0; d < num_an && an[d].cfg.verbosity; d += 1) {
+		struct capture_timing const* t = &an[d].timing;
+		fprintf(stderr, "%s: arm to trigger %.3lfms, read %zu bytes in %.3lfms\n", an[d].path,
+			(t->t_first - t->t_run) * 1e3, an[d].bytes, (t->t_last - t->t_first) * 1e3);
+	}
+
+	output_begin(out, index);
+	write_merged_vcd(out, an, num_an);
+	output_end(out, index);
+}
+
+/* The device's trigger runs with a level, starting at 0. A stage arms once
+ * the level reaches its own, then compares each sample (or, in serial mode,
+ * the last 32 bits seen on its channel, newest in bit 0) against its
+ * mask/value. After a match and its delay in samples it either starts the
+ * capture or advances the level, and is done until the next run. So a stage
+ * can only arm if enough non-start stages at lower levels can fire first, and
+ * something has to start the capture. */
+static void check_trigger_stages(struct cfg const* cfg)
+{
+	unsigned reach = 0;
+	for(;;) {
+		unsigned steps = 0;
+		for(unsigned i = 0; i < cfg->num_stages; i += 1) {
+			if(!cfg->stages[i].start && cfg->stages[i].level <= reach) {
+				steps += 1;
+			}
+		}
+		if(reach == 3 || steps <= reach) {
+			break;
+		}
+		reach += 1;
+	}
+
+	bool start = false;
+	for(unsigned i = 0; i < cfg->num_stages; i += 1) {
+		struct trigger_stage const* ts = &cfg->stages[i];
+		if(ts->level > reach) {
+			fprintf(stderr, "Trigger stage %u is at level %u but only levels up to %u can be reached\n",
+				i, ts->level, reach);
+			exit(EXIT_FAILURE);
+		}
+		if(ts->value & ~ts->mask) {
+			fprintf(stderr, "Warning: trigger stage %u value has bits outside its mask, they are ignored\n", i);
+		}
+		start = start || ts->start;
+	}
+	if(!start) {
+		fprintf(stderr, "No trigger stage starts the capture (add ,start to one)\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+/* The channels shorthand, once the enabled groups are known. Values are
+ * named by the channel number on the device, as disabled groups are left out
+ * of the samples. The table is copied first as it's shared with the cfg the
+ * device's one was copied from. */
+static void vcd_add_channels(struct cfg* cfg)
+{
+	if(!cfg->vcd.channels) {
+		return;
+	}
+	struct vcd_value* const values = cfg->vcd.values;
+	uint32_t const num_values = cfg->vcd.num_values;
+	cfg->vcd.values = NULL;
+	cfg->vcd.num_values = cfg->vcd.alloced = 0;
+	for(uint32_t vali = 0; vali < num_values; vali += 1) {
+		*vcd_add_value(cfg) = values[vali];
+	}
+
+	/* Only groups 0 and 1 are sampled in demux mode */
+	unsigned const groups = cfg->demux? cfg->group_enable & 0x3 : cfg->group_enable & cfg->group_mask;
+	unsigned bit = 0;
+	for(unsigned g = 0; g < 4; g += 1) {
+		if(!(groups & (1u << g))) {
+			continue;
+		}
+		for(unsigned c = 0; c < 8; c += 1, bit += 1) {
+			/* The top channel is the RLE flag */
+			if(cfg->rle && bit == cfg->num_groups_enabled * 8 - 1) {
+				break;
+			}
+			struct vcd_value* vv = vcd_add_value(cfg);
+			snprintf(vv->name, sizeof(vv->name), "ch%u", g * 8 + c);
+			vv->mask = 1u << bit;
+			vv->num_bits = 1;
+			vv->bitmasks[0] = vv->mask;
+		}
+	}
+	cfg->vcd.channels = false;
+}
+
+/* Fill in the derived config values, once the device info is known */
+static void cfg_finish(struct cfg* cfg, uint32_t after_trig)
+{
+	cfg->max_groups = (cfg->num_probes + 7) / 8;
+	cfg->group_mask = (1u << cfg->max_groups) - 1;
+
+	/* Default to all groups */
+	if(cfg->group_enable == 0) {
+		cfg->group_enable = cfg->demux? 0x3 : cfg->group_mask;
+	}
+
+	/* In demux mode only groups 0 and 1 are inputs, sampled twice per word
+	 * into groups 0/1 and 2/3. Counts are given in (double rate) samples and
+	 * converted to words here. */
+	if(cfg->demux) {
+		if(cfg->group_mask != 0xF) {
+			fprintf(stderr, "Demux needs a device with 32 channels\n");
+			exit(EXIT_FAILURE);
+		}
+		if(cfg->group_enable & ~0x3u) {
+			fprintf(stderr, "Warning: only channel groups 0 and 1 are available in demux mode.\n");
+		}
+		cfg->group_enable &= 0x3;
+		if(cfg->group_enable == 0) {
+			cfg->group_enable = 0x3;
+		}
+		cfg->group_enable |= cfg->group_enable << 2;
+		cfg->samples /= 2;
+		cfg->before_trig /= 2;
+		if(after_trig != UINT32_MAX) {
+			after_trig /= 2;
+		}
+	}
+
+	cfg->num_groups_enabled = 0;
+	for(unsigned n = cfg->group_enable & cfg->group_mask; n; n >>= 1) {
+		cfg->num_groups_enabled += n & 1;
+	}
+	vcd_add_channels(cfg);
+
+	/* Default to max samples */
+	uint32_t const max_samples = cfg->sample_memory / cfg->num_groups_enabled;
+	if(cfg->samples == 0) {
+		cfg->samples = max_samples;
+	}
+	if(cfg->samples > max_samples) {
+		fprintf(stderr, "Warning: requested more samples than the maximum (%u).\n", max_samples);
+		cfg->samples = max_samples;
+	}
+	/* The device counts in blocks of 4 samples, with a 16 bit count */
+	if(cfg->samples / 4 > UINT16_MAX) {
+		cfg->samples = UINT16_MAX * 4;
+		fprintf(stderr, "Warning: sample count limited to %u by the protocol.\n", cfg->samples);
+	}
+	if(cfg->samples % 4) {
+		cfg->samples &= ~3u;
+		fprintf(stderr, "Warning: sample count rounded down to a multiple of 4 (%u).\n", cfg->samples);
+	}
+	if(cfg->rle && cfg->verbosity) {
+		fprintf(stderr, "RLE: reading %u words, the time covered depends on the data. Channel %u is used as the RLE flag.\n",
+			cfg->samples, cfg->num_groups_enabled * 8 - 1);
+	}
+
+	/* after_trig overrides before_trig */
+	if(after_trig != UINT32_MAX) {
+		cfg->before_trig = cfg->samples - (after_trig > cfg->samples? cfg->samples : after_trig);
+	}
+	if(cfg->before_trig > cfg->samples) {
+		fprintf(stderr, "Warning: requested more samples before trigger (%u) than number captured (%u).\n", cfg->before_trig, cfg->samples);
+		cfg->before_trig = cfg->samples;
+	}
+
+	if(cfg->group_enable > cfg->group_mask) {
+		fprintf(stderr, "Warning: requested more channel groups (0x%X) than available (0x%X).\n", cfg->group_enable, cfg->group_mask);
+	}
+
+	if(cfg->clk_freq_hz == 0) {
+		fprintf(stderr, "Must specify clock frequency (clk_freq)\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+/* Replay a saved capture (raw output, or a capture file) through the same
+ * output code as a live capture, without a device. For raw files the capture
+ * settings (groups, clk_freq etc) have to be given as options, as when it was
+ * captured. */
+static void replay(char const* path, struct cfg* cfg, struct output* out)
+{
+	int fd = open(path, O_RDONLY);
+	if(fd == -1) {
+		fprintf(stderr, "Error opening %s: %s\n", path, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	struct stat st;
+	if(fstat(fd, &st) == -1) {
+		perror_exit("Error getting replay file size");
+	}
+	size_t const file_bytes = st.st_size;
+	uint8_t const* file = NULL;
+	if(file_bytes) {
+		file = mmap(NULL, file_bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+		if(file == MAP_FAILED) {
+			perror_exit("Error mapping replay file");
+		}
+	}
+
+	uint8_t const* data = file;
+	size_t data_bytes = file_bytes;
+	uint8_t* decoded = NULL;
+	struct sumpz_header zhdr;
+	struct capfile_header hdr;
+	if(file_bytes >= sizeof(hdr) && memcmp(file, "SUMPCAP", 8) == 0) {
+		memcpy(&hdr, file, sizeof(hdr));
+		if(hdr.version != CAPFILE_VERSION || hdr.samples_offset > file_bytes ||
+			hdr.samples_bytes > file_bytes - hdr.samples_offset || hdr.header_bytes > hdr.samples_offset ||
+			sizeof(hdr) + (uint64_t)hdr.num_values * sizeof(struct capfile_value) > hdr.header_bytes ||
+			hdr.num_stages > MAX_TRIGGER_STAGES) {
+			fprintf(stderr, "Unsupported or truncated capture file %s\n", path);
+			exit(EXIT_FAILURE);
+		}
+		data = file + hdr.samples_offset;
+		data_bytes = hdr.samples_bytes;
+
+		cfg->group_enable = hdr.group_enable;
+		cfg->num_probes = hdr.num_probes;
+		cfg->sample_memory = hdr.sample_memory;
+		cfg->clk_freq_hz = hdr.clk_freq_hz;
+		cfg->clk_divisor = hdr.clk_divisor;
+		cfg->trigger_mask = hdr.trigger_mask;
+		cfg->trigger_value = hdr.trigger_value;
+		cfg->num_stages = hdr.num_stages;
+		for(unsigned st = 0; st < hdr.num_stages; st += 1) {
+			struct capfile_stage const* cs = &hdr.stages[st];
+			cfg->stages[st] = (struct trigger_stage){
+				.mask = cs->mask,
+				.value = cs->value,
+				.delay = cs->delay,
+				.level = cs->level,
+				.channel = cs->channel,
+				.serial = cs->flags & CAPFILE_STAGE_SERIAL,
+				.start = cs->flags & CAPFILE_STAGE_START,
+			};
+		}
+		cfg->before_trig = hdr.trigger_sample;
+		if(hdr.flags & CAPFILE_TRUNCATED) {
+			cfg->truncated_from = hdr.requested_samples;
+		}
+		/* Use the file's value definitions unless others were given */
+		if(cfg->vcd.num_values == 0 && !cfg->vcd.channels) {
+			for(unsigned vali = 0; vali < hdr.num_values; vali += 1) {
+				struct capfile_value cv;
+				memcpy(&cv, &file[sizeof(hdr) + (size_t)vali * sizeof(cv)], sizeof(cv));
+				if(cv.num_bits > MAX_VCD_VALUE_BITS) {
+					fprintf(stderr, "Invalid value %u in capture file %s\n", vali, path);
+					exit(EXIT_FAILURE);
+				}
+				struct vcd_value* vv = vcd_add_value(cfg);
+				memcpy(vv->name, cv.name, MAX_VCD_NAME_LEN);
+				vv->name[MAX_VCD_NAME_LEN] = '\0';
+				vv->mask = cv.mask;
+				vv->num_bits = cv.num_bits;
+				memcpy(vv->bitmasks, cv.bitmasks, sizeof(vv->bitmasks));
+			}
+		}
+	}
+	else if(file_bytes >= sizeof(zhdr) && memcmp(file, "SUMPZ", 6) == 0) {
+		memcpy(&zhdr, file, sizeof(zhdr));
+		if(zhdr.version != SUMPZ_VERSION || zhdr.header_bytes > file_bytes || zhdr.chunk_samples == 0 ||
+			zhdr.bytes_per_sample == 0 || zhdr.bytes_per_sample > 4) {
+			fprintf(stderr, "Unsupported compressed file %s\n", path);
+			exit(EXIT_FAILURE);
+		}
+		data_bytes = (size_t)zhdr.num_samples * zhdr.bytes_per_sample;
+		decoded = malloc(data_bytes? data_bytes : 1);
+		assert(decoded);
+		double const t = monotonic_time();
+		if(!sumpz_decode(&zhdr, file + zhdr.header_bytes, file_bytes - zhdr.header_bytes, decoded)) {
+			fprintf(stderr, "Corrupt compressed file %s\n", path);
+			exit(EXIT_FAILURE);
+		}
+		double const t_decode = monotonic_time() - t;
+		if(cfg->verbosity) {
+			fprintf(stderr, "Decoded %zu bytes to %zu in %.3lfs: %.1lf MB/s of samples\n",
+				file_bytes, data_bytes, t_decode, t_decode > 0.0? data_bytes / t_decode / 1e6 : 0.0);
+		}
+		data = decoded;
+
+		cfg->group_enable = zhdr.group_enable;
+		cfg->num_probes = zhdr.num_probes;
+		cfg->clk_freq_hz = zhdr.clk_freq_hz;
+		cfg->clk_divisor = zhdr.clk_divisor;
+		cfg->before_trig = zhdr.trigger_sample;
+		if(zhdr.flags & SUMPZ_TRUNCATED) {
+			cfg->truncated_from = zhdr.requested_samples;
+		}
+	}
+
+	cfg->max_groups = (cfg->num_probes + 7) / 8;
+	cfg->group_mask = (1u << cfg->max_groups) - 1;
+	if(cfg->group_enable == 0) {
+		cfg->group_enable = cfg->group_mask;
+	}
+	cfg->num_groups_enabled = 0;
+	for(unsigned n = cfg->group_enable & cfg->group_mask; n; n >>= 1) {
+		cfg->num_groups_enabled += n & 1;
+	}
+	if(cfg->num_groups_enabled == 0) {
+		fprintf(stderr, "Groups 0x%X selects none of the %u groups in %s\n", cfg->group_enable, cfg->max_groups, path);
+		exit(EXIT_FAILURE);
+	}
+	vcd_add_channels(cfg);
+	if(cfg->clk_freq_hz == 0) {
+		fprintf(stderr, "Must specify clock frequency (clk_freq)\n");
+		exit(EXIT_FAILURE);
+	}
+
+	unsigned const groups = cfg->num_groups_enabled;
+	if(data_bytes % groups) {
+		fprintf(stderr, "Warning: ignoring %zu bytes of partial sample at end of %s\n", data_bytes % groups, path);
+	}
+	if(data_bytes / groups > UINT32_MAX) {
+		fprintf(stderr, "Replay file %s too large\n", path);
+		exit(EXIT_FAILURE);
+	}
+	uint32_t const num_samples = data_bytes / groups;
+	cfg->samples = num_samples;
+	if(cfg->before_trig > num_samples) {
+		cfg->before_trig = num_samples;
+	}
+
+	/* The output code takes samples as the device sends them, newest first */
+	struct readout ro = {
+		.tp = NULL,
+		.buf = malloc((size_t)num_samples * groups),
+		.bytes = (size_t)num_samples * groups,
+		.pos = (size_t)num_samples * groups,
+	};
+	assert(num_samples == 0 || ro.buf);
+	for(uint32_t i = 0; i < num_samples; i += 1) {
+		memcpy(&ro.buf[(size_t)(num_samples - 1 - i) * groups], &data[(size_t)i * groups], groups);
+	}
+	pthread_mutex_init(&ro.lock, NULL);
+	pthread_cond_init(&ro.cond, NULL);
+
+	double const t_start = monotonic_time();
+	output_begin(out, 0);
+	format_samples(&ro, cfg, out, num_samples);
+	output_end(out, 0);
+	double const t_done = monotonic_time();
+
+	if(cfg->verbosity) {
+		fprintf(stderr, "Replayed %u samples in %.3lfs: %.1lf ns/sample, %.1lf MB/s of samples\n", num_samples,
+			t_done - t_start, num_samples? (t_done - t_start) * 1e9 / num_samples : 0.0,
+			t_done > t_start? (double)num_samples * groups / (t_done - t_start) / 1e6 : 0.0);
+	}
+
+	pthread_cond_destroy(&ro.cond);
+	pthread_mutex_destroy(&ro.lock);
+	free(ro.buf);
+	free(decoded);
+	if(file_bytes) {
+		munmap((void*)file, file_bytes);
+	}
+	close(fd);
+}
+
+struct args {
+	char** argv;
+	unsigned argc;
+	unsigned pos;
+	void (*err)(struct args*, char*);
+};
+
+static char* args_pop(struct args* args)
+{
+	if(args->pos == args->argc) {
+		return NULL;
+	}
+	else {
+		return args->argv[args->pos++];
+	}
+}
+
+static void args_number(struct args* args, uint32_t* num, char* msg)
+{
+	char* arg = args_pop(args);
+	if(arg == NULL) {
+		args->err(args, msg);
+	}
+	char* end;
+	unsigned long long n = strtoull(arg, &end, 0);
+	if(end == arg || end[0] != '\0' || n > UINT32_MAX) {
+		args->err(args, msg);
+	}
+
+	*num = (uint32_t)n;
+}
+
+static void args_si_unit(struct args* args, uint32_t* num, char const* unit, char* msg)
+{
+	char* arg = args_pop(args);
+	if(arg == NULL) {
+		args->err(args, msg);
+	}
+	char* end;
+	unsigned long long n = strtoull(arg, &end, 0);
+	if(end == arg || n > UINT32_MAX) {
+		args->err(args, msg);
+	}
+	switch(end[0]) {
 		case 'M':
 		case 'm':
 			n *= 1000000;
@@ -536,6 +4857,26 @@ static void args_si_unit(struct args* args, uint32_t* num, char const* unit, cha
 	*num = (uint32_t)n;
 }
 
+static void args_seconds(struct args* args, double* secs, char* msg)
+{
+	char* arg = args_pop(args);
+	if(arg == NULL) {
+		args->err(args, msg);
+	}
+	char* end;
+	double v = strtod(arg, &end);
+	if(end == arg || v < 0.0) {
+		args->err(args, msg);
+	}
+	if(strcmp(end, "ms") == 0) {
+		v *= 1e-3;
+	}
+	else if(end[0] != '\0' && strcmp(end, "s") != 0) {
+		args->err(args, msg);
+	}
+	*secs = v;
+}
+
 static void args_numeqnum(struct args* args, uint32_t* num0, uint32_t* num1, char* msg)
 {
 	char* arg = args_pop(args);
@@ -578,10 +4919,15 @@ static void args_vcd_value(struct args* args, struct vcd_value* vv, char* msg)
 	}
 	memset(vv->name, 0, sizeof(vv->name));
 	strncpy(vv->name, arg, len);
+	/* Dots separate scopes, which can't be empty */
+	if(vv->name[0] == '.' || vv->name[len - 1] == '.' || strstr(vv->name, "..")) {
+		args->err(args, msg);
+	}
 
 	vv->mask = 0;
-	p += 1;
 	do {
+		/* Skip the '=' or ',' */
+		p += 1;
 		char* end;
 		unsigned long long n = strtoull(p, &end, 0);
 		if(end == p || n > UINT32_MAX) {
@@ -606,35 +4952,307 @@ static void args_vcd_value(struct args* args, struct vcd_value* vv, char* msg)
 	while(p[0] == ',');
 }
 
+/* <[serial<channel>:]mask=value>[,level=<n>][,delay=<n>][,start] */
+static void args_trigger_stage(struct args* args, struct trigger_stage* ts, char* msg)
+{
+	char* arg = args_pop(args);
+	if(arg == NULL) {
+		args->err(args, msg);
+	}
+
+	memset(ts, 0, sizeof(*ts));
+	char* p = arg;
+	char* end;
+	if(strncmp(p, "serial", 6) == 0) {
+		p += 6;
+		unsigned long n = strtoul(p, &end, 0);
+		if(end == p || end[0] != ':' || n > 31) {
+			args->err(args, msg);
+		}
+		ts->serial = true;
+		ts->channel = n;
+		p = &end[1];
+	}
+	unsigned long long n0 = strtoull(p, &end, 0);
+	if(end == p || end[0] != '=' || n0 > UINT32_MAX) {
+		args->err(args, msg);
+	}
+	p = &end[1];
+	unsigned long long n1 = strtoull(p, &end, 0);
+	if(end == p || n1 > UINT32_MAX) {
+		args->err(args, msg);
+	}
+	ts->mask = n0;
+	ts->value = n1;
+	p = end;
+
+	while(p[0] == ',') {
+		p += 1;
+		if(strcmp(p, "start") == 0 || strncmp(p, "start,", 6) == 0) {
+			ts->start = true;
+			p += 5;
+			continue;
+		}
+		bool const level = strncmp(p, "level=", 6) == 0;
+		if(!level && strncmp(p, "delay=", 6) != 0) {
+			args->err(args, msg);
+		}
+		p += 6;
+		unsigned long n = strtoul(p, &end, 0);
+		if(end == p || n > (level? 3 : UINT16_MAX)) {
+			args->err(args, msg);
+		}
+		if(level) {
+			ts->level = n;
+		}
+		else {
+			ts->delay = n;
+		}
+		p = end;
+	}
+	if(p[0] != '\0') {
+		args->err(args, msg);
+	}
+}
+
+/* <mask>=<value>[/<within>][,<mask>=<value>[/<within>]...] */
+static void args_find(struct args* args, struct cfg* cfg, char* msg)
+{
+	char* arg = args_pop(args);
+	if(arg == NULL) {
+		args->err(args, msg);
+	}
+
+	char* p = arg;
+	cfg->find.num_steps = 0;
+	do {
+		if(cfg->find.num_steps == MAX_FIND_STEPS) {
+			args->err(args, msg);
+		}
+		struct find_step* fs = &cfg->find.steps[cfg->find.num_steps];
+		if(cfg->find.num_steps > 0) {
+			/* Skip the ',' */
+			p += 1;
+		}
+		char* end;
+		unsigned long long n0 = strtoull(p, &end, 0);
+		if(end == p || end[0] != '=' || n0 > UINT32_MAX) {
+			args->err(args, msg);
+		}
+		p = &end[1];
+		unsigned long long n1 = strtoull(p, &end, 0);
+		if(end == p || n1 > UINT32_MAX) {
+			args->err(args, msg);
+		}
+		fs->mask = n0;
+		fs->value = n1 & n0;
+		fs->within = 1;
+		p = end;
+		if(p[0] == '/') {
+			p += 1;
+			unsigned long long n = strtoull(p, &end, 0);
+			if(end == p || n == 0 || n > UINT32_MAX || cfg->find.num_steps == 0) {
+				args->err(args, msg);
+			}
+			fs->within = n;
+			p = end;
+		}
+		cfg->find.num_steps += 1;
+	}
+	while(p[0] == ',');
+	if(p[0] != '\0') {
+		args->err(args, msg);
+	}
+}
+
+/* <uart|spi|i2c> followed by name=value parameters, as many as there are */
+static void args_decode(struct args* args, struct decoder_cfg* dc, char* msg)
+{
+	static char const* const protos[] = { "uart", "spi", "i2c" };
+	static char const* const signals[][DECODE_SIGNALS] = {
+		{ "rx" }, { "clk", "mosi", "miso", "cs" }, { "scl", "sda" },
+	};
+	char* arg = args_pop(args);
+	if(arg == NULL) {
+		args->err(args, msg);
+	}
+
+	memset(dc, 0, sizeof(*dc));
+	unsigned p = 0;
+	while(strcmp(arg, protos[p]) != 0) {
+		p += 1;
+		if(p == sizeof(protos) / sizeof(protos[0])) {
+			args->err(args, msg);
+		}
+	}
+	dc->proto = p;
+	strcpy(dc->name, protos[p]);
+	dc->bits = 8;
+
+	while(args->pos < args->argc && strchr(args->argv[args->pos], '=')) {
+		arg = args_pop(args);
+		char* val = strchr(arg, '=') + 1;
+		size_t const len = val - 1 - arg;
+		if(len == 4 && strncmp(arg, "name", 4) == 0) {
+			if(val[0] == '\0' || strlen(val) > MAX_VCD_NAME_LEN) {
+				args->err(args, msg);
+			}
+			strcpy(dc->name, val);
+			continue;
+		}
+		if(len == 6 && strncmp(arg, "parity", 6) == 0) {
+			if(strcmp(val, "none") == 0) {
+				dc->parity = 0;
+			}
+			else if(strcmp(val, "even") == 0 || strcmp(val, "odd") == 0) {
+				dc->parity = val[0];
+			}
+			else {
+				args->err(args, msg);
+			}
+			continue;
+		}
+
+		/* SI suffixes for the baud rate */
+		char* end;
+		unsigned long long n = strtoull(val, &end, 0);
+		if(end != val && (strcmp(end, "k") == 0 || strcmp(end, "K") == 0)) {
+			n *= 1000;
+			end += 1;
+		}
+		else if(end != val && (strcmp(end, "m") == 0 || strcmp(end, "M") == 0)) {
+			n *= 1000000;
+			end += 1;
+		}
+		if(end == val || end[0] != '\0' || n > UINT32_MAX) {
+			args->err(args, msg);
+		}
+		unsigned s = 0;
+		while(s < DECODE_SIGNALS && (signals[p][s] == NULL || strlen(signals[p][s]) != len
+			|| strncmp(arg, signals[p][s], len) != 0)) {
+			s += 1;
+		}
+		if(s < DECODE_SIGNALS) {
+			if(__builtin_popcountll(n) != 1) {
+				args->err(args, "Decoder signals must be a single channel");
+			}
+			dc->signals[s] = n;
+		}
+		else if(len == 4 && strncmp(arg, "baud", 4) == 0 && dc->proto == DECODE_UART && n > 0) {
+			dc->baud = n;
+		}
+		else if(len == 4 && strncmp(arg, "bits", 4) == 0 && n >= 1 && n <= (dc->proto == DECODE_UART? 9 : 32)) {
+			dc->bits = n;
+		}
+		else if(len == 4 && strncmp(arg, "mode", 4) == 0 && dc->proto == DECODE_SPI && n <= 3) {
+			dc->mode = n;
+		}
+		else {
+			args->err(args, msg);
+		}
+	}
+
+	bool const complete = dc->proto == DECODE_UART? dc->signals[0] && dc->baud
+		: dc->proto == DECODE_SPI? dc->signals[0] && dc->signals[1]
+		: dc->signals[0] && dc->signals[1];
+	if(!complete) {
+		args->err(args, "Decoder is missing signals: needs rx and baud (uart), clk and mosi (spi) or scl and sda (i2c)");
+	}
+}
+
 static void argerr(struct args* args, char* msg) {
 	if(msg) {
 		fprintf(stderr, "argument error: %s\n", msg);
 	}
-	fprintf(stderr, "Usage: %s <tty> [<options>]\n\n", args->argv[0]);
+	fprintf(stderr, "Usage: %s <tty|unix:<path>|tcp:<host>:<port>> [<options>]\n", args->argv[0]);
+	fprintf(stderr, "       %s replay <file> [<options>]\n\n", args->argv[0]);
 	fprintf(stderr, "Default mode is to dump sample data to stdout as hex, one sample per line.\n"
+		"Replay reads a capture saved with raw, capfile or compress instead of a device,\n"
+		"with the same output options. For raw files give the options it was captured with.\n"
 		"Example: %s /dev/ttyUSB1 trigger 0x1=0x1 groups 3 divisor 11 raw\n\n", args->argv[0]);
 	fprintf(stderr,
 		"groups <num>: mask of channel groups to enable (default = all groups).\n"
 		"	Each group is a block of 8 channels.\n"
 		"trigger <mask>=<value>: trigger condition.\n"
 		"	Capture will start when value of (channels & mask) == value.\n"
+		"stage [serial<ch>:]<mask>=<value>[,level=<n>][,delay=<n>][,start]: program the\n"
+		"	next of the four trigger stages instead (trigger is stage 0 with start).\n"
+		"	A stage arms once the trigger level (from 0) reaches its level, matches on\n"
+		"	the channels, or the last 32 bits on channel ch with serial, then after\n"
+		"	delay samples starts the capture if start is given or else raises the level.\n"
 		"divisor <num>: clock divisor to use for capture rate (default = 1).\n"
 		"samples <num>: number of samples to capture (default = max possible).\n"
 		"before <num>: number of samples (out of those captured) to return preceding the trigger (default = 4).\n"
 		"after <num>: number of samples (out of those captured) to return after the trigger (default = samples - before)\n"
 		"  This takes precedence over 'before'\n"
-		"rle: enable RLE sample compression (EXPERIMENTAL) (default = false).\n"
+		"rle: enable RLE sample compression (default = false).\n"
+		"	The sample counts are then in RLE words rather than samples, and the top channel\n"
+		"	of the enabled groups is used to flag run counts. Raw output is the RLE words.\n"
+		"demux: sample channels 0-15 at twice the clock rate (default = false).\n"
+		"	Only groups 0 and 1 are available, sample counts are at the doubled rate.\n"
 		"raw: dump sample data in binary to stdout (default = false).\n"
+		"capfile [overview]: write a binary capture file, with the capture settings and VCD value\n"
+		"    definitions, the samples and an index of where they change (default = false).\n"
+		"    overview adds a pyramid of which channels are high, low or toggling per block.\n"
+		"measure: instead of the samples, write a report of the edge count, frequency, duty\n"
+		"	cycle and high/low pulse widths of each channel, or of each vcd value if given.\n"
+		"find mask=value[/within],..: instead of the samples, list the first and last\n"
+		"	sample of every match of the sequence (and its time from the trigger). Each\n"
+		"	step after the first must match within that many samples of the last (default 1).\n"
+		"find_window <before> <after>: write the samples around each find match instead, as\n"
+		"	hex or VCD, with this many before and after it.\n"
+		"decode <uart|spi|i2c> <param>=<value>..: decode a bus, listing the frames with\n"
+		"	their times, or adding them as string values if there are vcd values. Signals\n"
+		"	are sample bit masks as for vcd: uart rx=, spi clk= mosi= [miso=] [cs=] and\n"
+		"	i2c scl= sda=. uart needs baud= and takes bits= (8) and parity=none|even|odd,\n"
+		"	spi takes mode= (0) and bits= (8). name= sets the name in the output.\n"
+		"compress [bitplanes]: write a compressed sample file, storing only where the\n"
+		"	samples change, or where each channel toggles with bitplanes (default = false).\n"
 		"vcd name=mask,mask..: dump samples in VCD format.\n"
 		"    Each instance adds the named value to the output using the specified bits.\n"
 		"    e.g. vcd clock=0x1 vcd data=0x6,0x80\n"
 		"    will add two values: a single bit clock from sample bit 0, and a 3 bit data value\n"
 		"    from sample bits 3,1,7 (in that order msb->lsb).\n"
+		"    Dots in a name nest the value in scopes, e.g. vcd cpu.bus.addr=0xff.\n"
+		"    vcd channels adds a single bit value per enabled channel, named ch<N>.\n"
 		"extmeta: device supports extended metadata command (0x04) (default = false)\n"
 		"	The following settings will be set from the metadata provided by the device\n"
 		"sample_memory: bytes of sample memory provided by the device (SI K & M suffixes allowed) (default = 16KB)\n"
 		"clk_freq: capture clock freqency (SI K & M suffixes allowed) (default = 100MHz)\n"
 		"num_probes: number of probes provided by the device (default = 32)\n"
+		"baud <rate>: serial baud rate, must match the device (SI K & M suffixes allowed) (default = 115200)\n"
+		"	Rates without a standard Bxxx constant are set through termios2 (Linux only).\n"
+		"rtscts: enable hardware (RTS/CTS) flow control (default = false).\n"
+		"lowlatency: put USB serial adapters in low latency mode (default = false).\n"
+		"simd <auto|scalar|sse2|avx2>: sample assembly kernel to use (default = auto).\n"
+		"threads <num|auto>: format hex, VCD and capfile output on this many threads,\n"
+		"	auto is one per CPU. At most one per 4096 sample chunk is used (default = 1).\n"
+		"trigger_timeout <secs>: give up if no data arrives this long after arming\n"
+		"	(default = wait forever). Can be given in ms, e.g. 500ms.\n"
+		"stall_timeout <secs>: give up if data stops arriving for this long, also used\n"
+		"	for replies to the ident and metadata commands (default = wait forever).\n"
+		"salvage: on a timeout, write out the samples received so far (the newest ones),\n"
+		"	marked as truncated in the output, and exit with status 2.\n"
+		"progress: show bytes received and the read rate on stderr during readout.\n"
+		"quiet: only print warnings and errors to stderr.\n"
+		"verbose: also log the protocol commands sent to stderr.\n"
+		"stats json: print timing and throughput of each capture phase to stderr, as a\n"
+		"	JSON object per capture (single device captures only).\n"
+		"repeat <num|forever>: number of captures to take (default = 1).\n"
+		"	The device is kept open and re-armed as soon as each readout completes.\n"
+		"output <path>: write output to a file rather than stdout (default = stdout).\n"
+		"	If the path contains a %%u conversion each capture goes to its own file, numbered\n"
+		"	by capture. Otherwise multiple captures are written to the one stream, each\n"
+		"	preceded by a 'SUMP-CAPTURE <num> <bytes>' line.\n"
+		"rotate <num>: cycle through this many numbered output files (default = no limit).\n"
+		"segments <num>: take this many captures and stitch them into one hex or VCD\n"
+		"	output, each at the time it was taken, with the gaps marked (default = 1).\n"
+		"segment_trigger <fixed|last>: trigger each segment after the first on the\n"
+		"	configured trigger, or on the channels (those in the trigger mask, or all)\n"
+		"	returning to the state the last segment ended in (default = fixed).\n"
+		"device <tty>: also capture from another device, at the same time (VCD output only).\n"
+		"	The output has each device's values in its own scope, aligned on the trigger.\n"
+		"	Salvage, progress and stats json are single device only.\n"
 		);
 	exit(EXIT_FAILURE);
 }
@@ -649,18 +5267,47 @@ int main(int argc, char** argv)
 	/* Only used to derive cfg.before_trig */
 	uint32_t after_trig = UINT32_MAX;
 
+	char const* paths[MAX_DEVICES] = { argv[1] };
+	unsigned num_paths = 1;
+
+	char const* replay_path = NULL;
+	if(strcmp(argv[1], "replay") == 0) {
+		if(argc < 3) {
+			argerr(&args, "Missing replay file");
+		}
+		replay_path = argv[2];
+		args.pos = 3;
+	}
+
 	struct cfg cfg = {
 		.trigger_mask = 0, .trigger_value = 0,
 		.clk_divisor = 1,
 		.before_trig = 4,
 		.rle = false,
 		.raw = false,
+		.capfile = false,
+		.overview = false,
 		.vcd = { .num_values = 0, },
 		/* Default to papilio pro as that is what I use... */
 		.num_probes = 32,
 		.sample_memory = (1u << 16),
 		.clk_freq_hz = 100000000,
 		.ext_meta = false,
+		.simd = SIMD_AUTO,
+		.threads = 1,
+		.stats_json = false,
+		.verbosity = 1,
+		.trigger_timeout = 0.0,
+		.stall_timeout = 0.0,
+		.progress = false,
+		.salvage = false,
+		.truncated_from = 0,
+		.repeat = 1,
+		.output_path = NULL,
+		.rotate = 0,
+		.baud = 115200,
+		.rtscts = false,
+		.low_latency = false,
 	};
 
 	while(args.pos < args.argc) {
@@ -677,6 +5324,14 @@ int main(int argc, char** argv)
 		else if(strcmp(opt, "samples") == 0) {
 			args_number(&args, &cfg.samples, "Invalid samples count");
 		}
+		else if(strcmp(opt, "stage") == 0) {
+			if(cfg.num_stages == MAX_TRIGGER_STAGES) {
+				argerr(&args, "Too many trigger stages specified");
+			}
+			args_trigger_stage(&args, &cfg.stages[cfg.num_stages], "Invalid trigger stage: must be "
+				"[serial<channel>:]mask=value[,level=<n>][,delay=<n>][,start]");
+			cfg.num_stages += 1;
+		}
 		else if(strcmp(opt, "before") == 0) {
 			args_number(&args, &cfg.before_trig, "Invalid before trigger samples count");
 		}
@@ -689,6 +5344,26 @@ int main(int argc, char** argv)
 		else if(strcmp(opt, "raw") == 0) {
 			cfg.raw = true;
 		}
+		else if(strcmp(opt, "measure") == 0) {
+			cfg.measure = true;
+		}
+		else if(strcmp(opt, "demux") == 0) {
+			cfg.demux = true;
+		}
+		else if(strcmp(opt, "capfile") == 0) {
+			cfg.capfile = true;
+			if(args.pos < args.argc && strcmp(args.argv[args.pos], "overview") == 0) {
+				args_pop(&args);
+				cfg.overview = true;
+			}
+		}
+		else if(strcmp(opt, "compress") == 0) {
+			cfg.compress = true;
+			if(args.pos < args.argc && strcmp(args.argv[args.pos], "bitplanes") == 0) {
+				args_pop(&args);
+				cfg.bitplanes = true;
+			}
+		}
 		else if(strcmp(opt, "clk_freq") == 0) {
 			args_si_unit(&args, &cfg.clk_freq_hz, "hz", "Invalid clock frequency");
 		}
@@ -698,66 +5373,352 @@ int main(int argc, char** argv)
 		else if(strcmp(opt, "num_probes") == 0) {
 			args_number(&args, &cfg.num_probes, "Invalid probe count");
 		}
+		else if(strcmp(opt, "baud") == 0) {
+			args_si_unit(&args, &cfg.baud, "baud", "Invalid baud rate");
+			if(cfg.baud == 0) {
+				argerr(&args, "Invalid baud rate");
+			}
+		}
+		else if(strcmp(opt, "rtscts") == 0) {
+			cfg.rtscts = true;
+		}
+		else if(strcmp(opt, "lowlatency") == 0) {
+			cfg.low_latency = true;
+		}
+		else if(strcmp(opt, "repeat") == 0) {
+			char* n = args.pos < args.argc? args.argv[args.pos] : NULL;
+			if(n && strcmp(n, "forever") == 0) {
+				args_pop(&args);
+				cfg.repeat = UINT32_MAX;
+			}
+			else {
+				args_number(&args, &cfg.repeat, "Invalid repeat count: must be number or 'forever'");
+				if(cfg.repeat == 0) {
+					argerr(&args, "Invalid repeat count: must be number or 'forever'");
+				}
+			}
+		}
+		else if(strcmp(opt, "threads") == 0) {
+			char* n = args.pos < args.argc? args.argv[args.pos] : NULL;
+			if(n && strcmp(n, "auto") == 0) {
+				args_pop(&args);
+				long const cpus = sysconf(_SC_NPROCESSORS_ONLN);
+				cfg.threads = cpus > 0? (unsigned)cpus : 1;
+			}
+			else {
+				args_number(&args, &cfg.threads, "Invalid thread count: must be number or 'auto'");
+				if(cfg.threads == 0) {
+					argerr(&args, "Invalid thread count: must be number or 'auto'");
+				}
+			}
+			if(cfg.threads > MAX_FORMAT_THREADS) {
+				cfg.threads = MAX_FORMAT_THREADS;
+			}
+		}
+		else if(strcmp(opt, "device") == 0) {
+			if(num_paths == MAX_DEVICES) {
+				argerr(&args, "Too many devices specified");
+			}
+			paths[num_paths] = args_pop(&args);
+			if(paths[num_paths] == NULL) {
+				argerr(&args, "Missing device path");
+			}
+			num_paths += 1;
+		}
+		else if(strcmp(opt, "output") == 0) {
+			cfg.output_path = args_pop(&args);
+			if(cfg.output_path == NULL) {
+				argerr(&args, "Missing output path");
+			}
+		}
+		else if(strcmp(opt, "rotate") == 0) {
+			args_number(&args, &cfg.rotate, "Invalid rotate count");
+		}
+		else if(strcmp(opt, "simd") == 0) {
+			char* kernel = args_pop(&args);
+			if(kernel == NULL) {
+				argerr(&args, "Missing SIMD kernel");
+			}
+			else if(strcmp(kernel, "auto") == 0) {
+				cfg.simd = SIMD_AUTO;
+			}
+			else if(strcmp(kernel, "scalar") == 0) {
+				cfg.simd = SIMD_SCALAR;
+			}
+			else if(strcmp(kernel, "sse2") == 0) {
+				cfg.simd = SIMD_SSE2;
+			}
+			else if(strcmp(kernel, "avx2") == 0) {
+				cfg.simd = SIMD_AVX2;
+			}
+			else {
+				argerr(&args, "Unknown SIMD kernel");
+			}
+		}
+		else if(strcmp(opt, "stats") == 0) {
+			char* fmt = args_pop(&args);
+			if(fmt == NULL || strcmp(fmt, "json") != 0) {
+				argerr(&args, "Unknown stats format: must be json");
+			}
+			cfg.stats_json = true;
+		}
+		else if(strcmp(opt, "trigger_timeout") == 0) {
+			args_seconds(&args, &cfg.trigger_timeout, "Invalid trigger timeout");
+		}
+		else if(strcmp(opt, "stall_timeout") == 0) {
+			args_seconds(&args, &cfg.stall_timeout, "Invalid stall timeout");
+		}
+		else if(strcmp(opt, "progress") == 0) {
+			cfg.progress = true;
+		}
+		else if(strcmp(opt, "salvage") == 0) {
+			cfg.salvage = true;
+		}
+		else if(strcmp(opt, "segments") == 0) {
+			args_number(&args, &cfg.segments, "Invalid segment count");
+		}
+		else if(strcmp(opt, "segment_trigger") == 0) {
+			char* mode = args_pop(&args);
+			if(mode && strcmp(mode, "fixed") == 0) {
+				cfg.segment_last = false;
+			}
+			else if(mode && strcmp(mode, "last") == 0) {
+				cfg.segment_last = true;
+			}
+			else {
+				argerr(&args, "Unknown segment trigger: must be fixed or last");
+			}
+		}
+		else if(strcmp(opt, "quiet") == 0) {
+			cfg.verbosity = 0;
+		}
+		else if(strcmp(opt, "verbose") == 0) {
+			cfg.verbosity = 2;
+		}
 		else if(strcmp(opt, "extmeta") == 0) {
-			cfg.ext_meta = false;
+			cfg.ext_meta = true;
+		}
+		else if(strcmp(opt, "find") == 0) {
+			args_find(&args, &cfg, "Invalid find pattern: must be mask=value[/within],...");
+		}
+		else if(strcmp(opt, "find_window") == 0) {
+			args_number(&args, &cfg.find.before, "Invalid find window samples before");
+			args_number(&args, &cfg.find.after, "Invalid find window samples after");
+			cfg.find.window = true;
+		}
+		else if(strcmp(opt, "decode") == 0) {
+			if(cfg.decode.num_decoders == MAX_DECODERS) {
+				argerr(&args, "Too many decoders specified");
+			}
+			args_decode(&args, &cfg.decode.decoders[cfg.decode.num_decoders], "Invalid decoder: must be "
+				"uart|spi|i2c followed by its name=value parameters");
+			cfg.decode.num_decoders += 1;
 		}
 		else if(strcmp(opt, "vcd") == 0) {
-			if(cfg.vcd.num_values == MAX_VCD_VALUES) {
-				argerr(&args, "Too many VCD values specified");
+			if(args.pos < args.argc && strcmp(args.argv[args.pos], "channels") == 0) {
+				args_pop(&args);
+				cfg.vcd.channels = true;
+			}
+			else {
+				args_vcd_value(&args, vcd_add_value(&cfg), "Invalid VCD value specifier");
 			}
-			args_vcd_value(&args, &cfg.vcd.values[cfg.vcd.num_values], "Invalid VCD value specifier");
-			cfg.vcd.num_values += 1;
 		}
 		else {
 			argerr(&args, "Unknown argument");
 		}
 	}
 
-	int fd = open(argv[1], O_RDWR | O_NOCTTY);
-	if(fd == -1) {
-		fprintf(stderr, "Error opening %s: %s\n", argv[1], strerror(errno));
+	if(num_paths > 1) {
+		if((cfg.vcd.num_values == 0 && !cfg.vcd.channels) || cfg.raw || cfg.capfile || cfg.compress) {
+			fprintf(stderr, "Multiple devices are only supported with VCD output\n");
+			exit(EXIT_FAILURE);
+		}
+		if(cfg.rle) {
+			fprintf(stderr, "RLE is not supported with multiple devices\n");
+			exit(EXIT_FAILURE);
+		}
+		if(cfg.demux) {
+			fprintf(stderr, "Demux is not supported with multiple devices\n");
+			exit(EXIT_FAILURE);
+		}
+		if(cfg.measure) {
+			fprintf(stderr, "Measure is not supported with multiple devices\n");
+			exit(EXIT_FAILURE);
+		}
+		if(cfg.salvage || cfg.progress || cfg.stats_json) {
+			fprintf(stderr, "Salvage, progress and stats json are not supported with multiple devices\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if(cfg.num_stages) {
+		if(cfg.trigger_mask) {
+			fprintf(stderr, "Use either trigger or stage, not both\n");
+			exit(EXIT_FAILURE);
+		}
+		if(cfg.segment_last) {
+			fprintf(stderr, "segment_trigger last only works with a single trigger, not stages\n");
+			exit(EXIT_FAILURE);
+		}
+		check_trigger_stages(&cfg);
+	}
+	if(cfg.find.window && cfg.find.num_steps == 0) {
+		fprintf(stderr, "find_window needs a find pattern\n");
+		exit(EXIT_FAILURE);
+	}
+	if(cfg.find.num_steps) {
+		if(cfg.raw || cfg.capfile || cfg.compress || cfg.measure || cfg.rle) {
+			fprintf(stderr, "Find only works with hex or VCD output, and not with RLE\n");
+			exit(EXIT_FAILURE);
+		}
+		if(cfg.segments > 1 || num_paths > 1) {
+			fprintf(stderr, "Find can't be combined with segments or multiple devices\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	if(cfg.decode.num_decoders) {
+		if(cfg.raw || cfg.capfile || cfg.compress || cfg.measure || cfg.find.num_steps) {
+			fprintf(stderr, "Decoders write a list of frames or VCD, they can't be combined with raw, "
+				"capfile, compress, measure or find\n");
+			exit(EXIT_FAILURE);
+		}
+		if(cfg.rle && (cfg.vcd.num_values || cfg.vcd.channels)) {
+			fprintf(stderr, "Decoding RLE captures only works without vcd (as a list of frames)\n");
+			exit(EXIT_FAILURE);
+		}
+		if(cfg.segments > 1 || num_paths > 1) {
+			fprintf(stderr, "Decoders can't be combined with segments or multiple devices\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	if(cfg.measure && (cfg.raw || cfg.capfile || cfg.compress)) {
+		fprintf(stderr, "Measure writes a report, it can't be combined with raw, capfile or compress\n");
+		exit(EXIT_FAILURE);
+	}
+	if(cfg.segments > 1) {
+		if(cfg.raw || cfg.capfile || cfg.compress || cfg.measure || cfg.rle) {
+			fprintf(stderr, "Segmented captures are only supported with hex or VCD output\n");
+			exit(EXIT_FAILURE);
+		}
+		if(cfg.repeat != 1 || num_paths > 1 || replay_path) {
+			fprintf(stderr, "Segmented captures can't be combined with repeat, replay or multiple devices\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	if(cfg.compress && (cfg.raw || cfg.capfile || cfg.rle)) {
+		fprintf(stderr, "Compress can't be combined with raw, capfile or RLE\n");
 		exit(EXIT_FAILURE);
 	}
 
-	setup_serial(fd);
+	if(cfg.capfile && cfg.raw) {
+		fprintf(stderr, "Raw and capfile are separate output formats, choose one\n");
+		exit(EXIT_FAILURE);
+	}
+	if(replay_path) {
+		if(cfg.demux) {
+			fprintf(stderr, "Demuxed captures are saved unpacked, replay them with clk_freq doubled instead of demux\n");
+			exit(EXIT_FAILURE);
+		}
+		if(num_paths > 1) {
+			fprintf(stderr, "Can't replay to multiple devices\n");
+			exit(EXIT_FAILURE);
+		}
+		struct output out;
+		output_init(&out, &cfg);
+		replay(replay_path, &cfg, &out);
+		output_close(&out);
+		return 0;
+	}
 
-	read_ident(fd, &cfg);
+	if(cfg.capfile && cfg.rle) {
+		fprintf(stderr, "Capture files don't support RLE captures\n");
+		exit(EXIT_FAILURE);
+	}
+	if(cfg.demux && cfg.rle) {
+		fprintf(stderr, "RLE is not supported in demux mode\n");
+		exit(EXIT_FAILURE);
+	}
 
-	/* This goes after read_ident as some of the values used may be filled in
-	 * from the extended metadata (if enabled) */
-	cfg.max_groups = (cfg.num_probes + 7) / 8;
-	cfg.group_mask = (1u << cfg.max_groups) - 1;
+	double const t_start = monotonic_time();
+	double t_setup = 0.0, t_ident = 0.0;
+	struct analyser an[MAX_DEVICES];
+	for(unsigned d = 0; d < num_paths; d += 1) {
+		an[d] = (struct analyser){ .path = paths[d], .cfg = cfg };
+		struct device* dev = &an[d].dev;
+		dev->configured = false;
+		dev->armed = false;
+		dev->tp.trace = cfg.verbosity >= 2;
+		dev->tp.timeout = cfg.stall_timeout;
+		transport_open(&dev->tp, paths[d], cfg.baud, cfg.rtscts, cfg.low_latency);
+		double const t_open = monotonic_time();
 
-	/* Default to all groups */
-	if(cfg.group_enable == 0) {
-		cfg.group_enable = cfg.group_mask;
+		/* Derived values go after read_ident as some of the values used may
+		 * be filled in from the extended metadata (if enabled) */
+		read_ident(&dev->tp, &an[d].cfg);
+		if(d == 0) {
+			t_setup = t_open - t_start;
+			t_ident = monotonic_time() - t_open;
+		}
+		cfg_finish(&an[d].cfg, after_trig);
 	}
 
-	cfg.num_groups_enabled = 0;
-	for(unsigned n = cfg.group_enable & cfg.group_mask; n; n >>= 1) {
-		cfg.num_groups_enabled += 1;
-	}
+	struct output out;
+	output_init(&out, &cfg);
 
-	/* Default to max samples */
-	if(cfg.samples == 0) {
-		cfg.samples = cfg.sample_memory / cfg.num_groups_enabled;
+	if(num_paths > 1) {
+		for(unsigned d = 0; d < num_paths; d += 1) {
+			an[d].bytes = (size_t)an[d].cfg.samples * an[d].cfg.num_groups_enabled;
+			an[d].buf = malloc(an[d].bytes);
+			assert(an[d].bytes == 0 || an[d].buf);
+		}
+		for(uint32_t n = 0; cfg.repeat == UINT32_MAX || n < cfg.repeat; n += 1) {
+			capture_analysers(an, num_paths, &out, n);
+		}
+		output_close(&out);
+		for(unsigned d = 0; d < num_paths; d += 1) {
+			free(an[d].buf);
+			close(an[d].dev.tp.fd);
+		}
+		return 0;
 	}
 
-	/* after_trig overrides before_trig */
-	if(after_trig != UINT32_MAX) {
-		cfg.before_trig = cfg.samples - (after_trig > cfg.samples? cfg.samples : after_trig);
+	struct device* dev = &an[0].dev;
+	if(cfg.segments > 1) {
+		int const status = capture_segments(dev, &an[0].cfg, &out, t_setup, t_ident);
+		output_close(&out);
+		close(dev->tp.fd);
+		return status;
 	}
 
-	if(cfg.group_enable > cfg.group_mask) {
-		fprintf(stderr, "Warning: requested more channel groups (0x%X) than available (0x%X).\n", cfg.group_enable, cfg.group_mask);
-	}
+	double prev_last = 0.0;
+	int status = EXIT_SUCCESS;
+	for(uint32_t n = 0; cfg.repeat == UINT32_MAX || n < cfg.repeat; n += 1) {
+		bool const more = cfg.repeat == UINT32_MAX || n + 1 < cfg.repeat;
+		struct capture_timing timing = { .t_begin = 0.0 };
+		capture(dev, &an[0].cfg, &out, n, more, &timing);
+		if(cfg.stats_json) {
+			write_stats_json(stderr, &an[0].cfg, n, t_setup, t_ident, &timing);
+		}
 
-	if(cfg.clk_freq_hz == 0) {
-		fprintf(stderr, "Must specify clock frequency (clk_freq)\n");
-		exit(EXIT_FAILURE);
-	}
+		if(cfg.repeat != 1 && cfg.verbosity) {
+			fprintf(stderr, "Capture %u: arm to trigger %.3lfms, readout %.3lfms, output %.3lfms",
+				n, (timing.t_first - timing.t_run) * 1e3, (timing.t_last - timing.t_first) * 1e3,
+				(timing.t_done - timing.t_last) * 1e3);
+			if(n > 0) {
+				fprintf(stderr, ", dead time %.3lfms", (timing.t_run - prev_last) * 1e3);
+			}
+			fprintf(stderr, "\n");
+		}
+		prev_last = timing.t_last;
 
-	capture(fd, &cfg);
+		/* The device is in an unknown state after a timeout */
+		if(timing.truncated) {
+			status = cfg.salvage? 2 : EXIT_FAILURE;
+			break;
+		}
+	}
 
-	close(fd);
+	output_close(&out);
+	close(dev->tp.fd);
+	return status;
 }
@@ -0,0 +1,887 @@
+/*
+Copyright (c) 2017 Thomas Spurden <thomas@spurden.name>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+/* Emulates a SUMP logic analyser on a pseudo-terminal so sump-dump can be run
+ * (and timed) without any hardware attached.
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <termios.h>
+#include <time.h>
+
+static void perror_exit(char const* msg)
+{
+	perror(msg);
+	exit(EXIT_FAILURE);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+enum pattern {
+	PATTERN_COUNTER,
+	PATTERN_RANDOM,
+	PATTERN_WALK,
+	PATTERN_CONST,
+};
+
+struct emu_cfg {
+	enum pattern pattern;
+	double density; /* Probability of a sample differing from the previous one (random) */
+	uint32_t seed;
+	uint32_t rate; /* Bytes per second sent, 0 = unlimited, UINT32_MAX = follow tty baud */
+	uint32_t sample_memory, num_probes, clk_freq_hz;
+	bool verbose;
+	char const* listen_path; /* Unix socket to serve on instead of a pty */
+};
+
+/* Device state as programmed by the host */
+struct emu {
+	struct emu_cfg const* cfg;
+	int master, slave;
+	int listener;
+	pid_t child;
+	int child_status;
+	double t_exit;
+
+	uint32_t divider;
+	uint16_t read_count, delay_count;
+	uint8_t flags[4];
+	struct {
+		uint32_t mask, value, cfg;
+	} stages[4];
+
+	uint32_t rng;
+
+	/* Stats for the last capture */
+	unsigned captures;
+	uint64_t bytes_sent, samples_sent;
+	double t_run, t_last;
+};
+
+static uint32_t xorshift32(uint32_t* state)
+{
+	uint32_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*state = x;
+	return x;
+}
+
+static uint32_t next_sample(struct emu* emu, uint32_t prev, uint64_t i)
+{
+	switch(emu->cfg->pattern) {
+		case PATTERN_COUNTER:
+			return (uint32_t)i;
+		case PATTERN_WALK:
+			return 1u << (i % 32);
+		case PATTERN_CONST:
+			return emu->cfg->seed;
+		case PATTERN_RANDOM:
+		default:
+			if((double)xorshift32(&emu->rng) < emu->cfg->density * 4294967296.0) {
+				uint32_t flip = xorshift32(&emu->rng);
+				return prev ^ (flip? flip : 1);
+			}
+			return prev;
+	}
+}
+
+static void sigchld(int sig)
+{
+	/* Only here to interrupt poll() */
+	(void)sig;
+}
+
+static bool child_exited(struct emu* emu)
+{
+	if(emu->child == 0) {
+		return emu->t_exit != 0.0;
+	}
+	pid_t p = waitpid(emu->child, &emu->child_status, WNOHANG);
+	if(p == emu->child) {
+		emu->t_exit = now();
+		emu->child = 0;
+		return true;
+	}
+	return false;
+}
+
+/* Write to the pty, giving up if the process under test has gone away (the
+ * emulator holds the slave open so writes would otherwise block forever) */
+static bool emu_write(struct emu* emu, uint8_t const* buf, size_t len)
+{
+	size_t pos = 0;
+	while(pos < len) {
+		struct pollfd pfd = { .fd = emu->master, .events = POLLOUT };
+		int r = poll(&pfd, 1, 100);
+		if(r == -1 && errno != EINTR) {
+			perror_exit("poll");
+		}
+		if(r <= 0) {
+			if(child_exited(emu)) {
+				return false;
+			}
+			continue;
+		}
+		ssize_t sz = write(emu->master, &buf[pos], len - pos);
+		if(sz == -1) {
+			if(errno == EAGAIN || errno == EINTR) {
+				continue;
+			}
+			perror_exit("Error writing to pty");
+		}
+		pos += sz;
+	}
+	return true;
+}
+
+#ifdef __linux__
+/* See sump-dump.c: <asm/termbits.h> clashes with <termios.h> */
+struct termios2 {
+	tcflag_t c_iflag, c_oflag, c_cflag, c_lflag;
+	cc_t c_line;
+	cc_t c_cc[19];
+	speed_t c_ispeed, c_ospeed;
+};
+#endif
+
+static uint32_t tty_baud(struct emu* emu)
+{
+	/* No baud rate on a socket, so no limit */
+	if(emu->listener != -1) {
+		return 0;
+	}
+#if defined(__linux__) && defined(TCGETS2)
+	struct termios2 tios2;
+	if(ioctl(emu->master, TCGETS2, &tios2) == -1) {
+		perror_exit("TCGETS2");
+	}
+	return tios2.c_ospeed;
+#else
+	struct termios tios;
+	if(tcgetattr(emu->master, &tios) == -1) {
+		perror_exit("tcgetattr");
+	}
+	static struct { speed_t speed; uint32_t baud; } const speeds[] = {
+		{ B9600, 9600 }, { B19200, 19200 }, { B38400, 38400 }, { B57600, 57600 },
+		{ B115200, 115200 }, { B230400, 230400 },
+	};
+	speed_t s = cfgetospeed(&tios);
+	for(unsigned i = 0; i < sizeof(speeds) / sizeof(speeds[0]); i += 1) {
+		if(speeds[i].speed == s) {
+			return speeds[i].baud;
+		}
+	}
+	return 115200;
+#endif
+}
+
+static void send_metadata(struct emu* emu)
+{
+	uint8_t buf[64];
+	unsigned len = 0;
+	char const name[] = "sump-emu";
+
+	buf[len++] = 0x01;
+	memcpy(&buf[len], name, sizeof(name));
+	len += sizeof(name);
+
+	uint32_t const vals[][2] = {
+		{ 0x20, emu->cfg->num_probes },
+		{ 0x21, emu->cfg->sample_memory },
+		{ 0x23, emu->cfg->clk_freq_hz },
+	};
+	for(unsigned i = 0; i < 3; i += 1) {
+		buf[len++] = vals[i][0];
+		buf[len++] = (vals[i][1] >> 24) & 0xFF;
+		buf[len++] = (vals[i][1] >> 16) & 0xFF;
+		buf[len++] = (vals[i][1] >> 8) & 0xFF;
+		buf[len++] = vals[i][1] & 0xFF;
+	}
+	buf[len++] = 0x41; /* Protocol version */
+	buf[len++] = 2;
+	buf[len++] = 0x00;
+
+	emu_write(emu, buf, len);
+}
+
+/* Trigger stage state while a capture runs. As on the device a stage arms
+ * once the trigger level reaches its own, compares each sample (or, in serial
+ * mode, the last 32 bits of one channel, newest in bit 0) against its
+ * mask/value, and after a match and its delay either starts the capture or
+ * advances the level. Each stage only fires once per run. */
+struct trigger {
+	unsigned level;
+	bool any_start;
+	struct {
+		bool armed, matched, fired;
+		uint32_t shift, delay_left;
+	} stages[4];
+};
+
+static void trigger_init(struct emu* emu, struct trigger* trig)
+{
+	memset(trig, 0, sizeof(*trig));
+	for(unsigned i = 0; i < 4; i += 1) {
+		if((emu->stages[i].cfg >> 27) & 1) {
+			trig->any_start = true;
+		}
+	}
+}
+
+/* Returns true when the capture should start on this sample */
+static bool trigger_step(struct emu* emu, struct trigger* trig, uint32_t sample)
+{
+	if(!trig->any_start) {
+		/* Nothing programmed to start it, so just go */
+		return true;
+	}
+	bool start = false;
+	unsigned steps = 0;
+	for(unsigned i = 0; i < 4; i += 1) {
+		uint32_t const cfg = emu->stages[i].cfg;
+		unsigned const channel = (cfg >> 20) & 0x1F;
+		bool const serial = (cfg >> 26) & 1;
+		trig->stages[i].shift = (trig->stages[i].shift << 1) | ((sample >> channel) & 1);
+		if(trig->stages[i].fired) {
+			continue;
+		}
+		if(!trig->stages[i].armed && trig->level >= ((cfg >> 16) & 0x3)) {
+			trig->stages[i].armed = true;
+		}
+		if(trig->stages[i].armed && !trig->stages[i].matched) {
+			uint32_t const v = serial? trig->stages[i].shift : sample;
+			if(((v ^ emu->stages[i].value) & emu->stages[i].mask) == 0) {
+				trig->stages[i].matched = true;
+				trig->stages[i].delay_left = cfg & 0xFFFF;
+			}
+		}
+		if(trig->stages[i].matched) {
+			if(trig->stages[i].delay_left == 0) {
+				trig->stages[i].fired = true;
+				if((cfg >> 27) & 1) {
+					start = true;
+				}
+				else {
+					steps += 1;
+				}
+			}
+			else {
+				trig->stages[i].delay_left -= 1;
+			}
+		}
+	}
+	trig->level = trig->level + steps > 3? 3 : trig->level + steps;
+	return start;
+}
+
+/* Generate a capture according to the programmed state and send it newest
+ * sample first, as the real device does */
+static void run_capture(struct emu* emu)
+{
+	uint32_t const read_samples = (uint32_t)emu->read_count * 4;
+	uint32_t const delay_samples = (uint32_t)emu->delay_count * 4;
+	uint32_t const before = read_samples > delay_samples? read_samples - delay_samples : 0;
+	unsigned const group_dis = (emu->flags[0] >> 2) & 0xF;
+
+	unsigned groups[4];
+	unsigned num_groups = 0;
+	for(unsigned g = 0; g < (emu->cfg->num_probes + 7) / 8; g += 1) {
+		if(!(group_dis & (1u << g))) {
+			groups[num_groups++] = g;
+		}
+	}
+
+	emu->t_run = now();
+	emu->rng = emu->cfg->seed? emu->cfg->seed : 1;
+
+	if(read_samples == 0 || num_groups == 0) {
+		return;
+	}
+
+	uint32_t* ring = malloc(read_samples * sizeof(uint32_t));
+	if(ring == NULL) {
+		perror_exit("malloc");
+	}
+
+	/* Samples are stored compacted down to the enabled groups. In RLE mode a
+	 * value word is followed by a count word (top bit of the enabled width
+	 * set) if it repeats, and that top channel is lost. */
+	bool const rle = emu->flags[1] & 0x01;
+	bool const demux = emu->flags[0] & 0x01;
+	uint32_t const rle_flag = 1u << (num_groups * 8 - 1);
+	uint64_t words = 0;
+#define STORE(w) do { ring[words % read_samples] = (w); words += 1; } while(0)
+
+	/* Run the pattern until the trigger fires with enough history behind it,
+	 * then for the post trigger delay */
+	uint64_t const search_limit = (uint64_t)1 << 28;
+	uint64_t i = 0;
+	uint32_t s = 0;
+	uint64_t trigger_at = UINT64_MAX;
+	uint32_t run_value = 0, run_count = 0;
+	bool in_run = false;
+	struct trigger trig;
+	trigger_init(emu, &trig);
+	while(trigger_at == UINT64_MAX || words < trigger_at + delay_samples) {
+		s = next_sample(emu, s, i);
+		/* In demux mode channels 0-15 are sampled twice per word, the
+		 * later sample going in groups 2 and 3 */
+		uint32_t w = s;
+		if(demux) {
+			i += 1;
+			s = next_sample(emu, s, i);
+			w = (w & 0xFFFF) | (s << 16);
+		}
+		uint32_t c = 0;
+		for(unsigned g = num_groups; g > 0; g -= 1) {
+			c = (c << 8) | ((w >> (groups[g - 1] * 8)) & 0xFF);
+		}
+		if(!rle) {
+			STORE(c);
+		}
+		else {
+			c &= ~rle_flag;
+			if(in_run && c == run_value && run_count < rle_flag - 1) {
+				run_count += 1;
+			}
+			else {
+				if(in_run) {
+					STORE(run_value);
+					if(run_count) {
+						STORE(rle_flag | run_count);
+					}
+				}
+				run_value = c;
+				run_count = 0;
+				in_run = true;
+			}
+		}
+
+		/* Position of the word this sample went into */
+		uint64_t const pos = rle? words : words - 1;
+		if(trigger_at == UINT64_MAX && pos >= before && trigger_step(emu, &trig, s)) {
+			trigger_at = pos;
+		}
+		i += 1;
+		if(trigger_at == UINT64_MAX && i == search_limit) {
+			/* Like the real thing we just sit there waiting */
+			fprintf(stderr, "emu: trigger did not fire\n");
+			free(ring);
+			return;
+		}
+	}
+	if(rle && in_run) {
+		STORE(run_value);
+		if(run_count) {
+			STORE(rle_flag | run_count);
+		}
+	}
+#undef STORE
+
+	uint32_t const bytes_per_sample = num_groups;
+	uint32_t rate = emu->cfg->rate == UINT32_MAX? tty_baud(emu) / 10 : emu->cfg->rate;
+
+	uint8_t buf[4096];
+	unsigned len = 0;
+	uint64_t sent = 0;
+	double const start = now();
+	for(uint32_t n = 0; n < read_samples; n += 1) {
+		uint32_t v = ring[(words - 1 - n) % read_samples];
+		for(unsigned g = 0; g < num_groups; g += 1) {
+			buf[len++] = (v >> (g * 8)) & 0xFF;
+		}
+		if(len + bytes_per_sample > (rate? 256 : sizeof(buf)) || n == read_samples - 1) {
+			if(rate) {
+				double const due = start + (double)sent / (double)rate;
+				double const wait = due - now();
+				if(wait > 0) {
+					struct timespec ts = { .tv_sec = (time_t)wait, .tv_nsec = (long)((wait - (time_t)wait) * 1e9) };
+					nanosleep(&ts, NULL);
+				}
+			}
+			if(!emu_write(emu, buf, len)) {
+				break;
+			}
+			sent += len;
+			len = 0;
+		}
+	}
+	free(ring);
+
+	emu->t_last = now();
+	emu->captures += 1;
+	emu->bytes_sent = sent;
+	emu->samples_sent = sent / bytes_per_sample;
+}
+
+static bool read_byte(struct emu* emu, uint8_t* b)
+{
+	while(1) {
+		struct pollfd pfd = { .fd = emu->master, .events = POLLIN };
+		int r = poll(&pfd, 1, 100);
+		if(r == -1 && errno != EINTR) {
+			perror_exit("poll");
+		}
+		if(r <= 0) {
+			if(child_exited(emu)) {
+				return false;
+			}
+			continue;
+		}
+		ssize_t sz = read(emu->master, b, 1);
+		if(sz == 1) {
+			return true;
+		}
+		if(sz == 0) {
+			/* Socket closed by the other end */
+			return false;
+		}
+		if(sz == -1 && (errno == EAGAIN || errno == EINTR)) {
+			continue;
+		}
+		perror_exit("Error reading from pty");
+	}
+}
+
+static void emulate(struct emu* emu)
+{
+	uint8_t cmd[5];
+	while(read_byte(emu, &cmd[0])) {
+		if(cmd[0] & 0x80) {
+			/* Long command */
+			for(unsigned i = 1; i < 5; i += 1) {
+				if(!read_byte(emu, &cmd[i])) {
+					return;
+				}
+			}
+		}
+		if(emu->cfg->verbose) {
+			fprintf(stderr, "emu: <");
+			for(unsigned i = 0; i < ((cmd[0] & 0x80)? 5 : 1); i += 1) {
+				fprintf(stderr, " %02X", cmd[i]);
+			}
+			fprintf(stderr, "\n");
+		}
+
+		uint32_t const arg = (uint32_t)cmd[1] | ((uint32_t)cmd[2] << 8)
+			| ((uint32_t)cmd[3] << 16) | ((uint32_t)cmd[4] << 24);
+		unsigned const stage = (cmd[0] >> 2) & 0x3;
+		switch(cmd[0]) {
+			case 0x00: /* Reset */
+				break;
+			case 0x01:
+				run_capture(emu);
+				break;
+			case 0x02:
+				emu_write(emu, (uint8_t const*)"1ALS", 4);
+				break;
+			case 0x04:
+				send_metadata(emu);
+				break;
+			case 0x11: /* XON */
+			case 0x13: /* XOFF */
+				break;
+			case 0x80:
+				emu->divider = arg & 0xFFFFFF;
+				break;
+			case 0x81:
+				emu->read_count = arg & 0xFFFF;
+				emu->delay_count = arg >> 16;
+				break;
+			case 0x82:
+				memcpy(emu->flags, &cmd[1], 4);
+				break;
+			case 0xC0: case 0xC4: case 0xC8: case 0xCC:
+				emu->stages[stage].mask = arg;
+				break;
+			case 0xC1: case 0xC5: case 0xC9: case 0xCD:
+				emu->stages[stage].value = arg;
+				break;
+			case 0xC2: case 0xC6: case 0xCA: case 0xCE:
+				emu->stages[stage].cfg = arg;
+				break;
+			default:
+				fprintf(stderr, "emu: unknown command 0x%02X\n", cmd[0]);
+				break;
+		}
+	}
+}
+
+static void open_pty(struct emu* emu)
+{
+	emu->master = posix_openpt(O_RDWR | O_NOCTTY);
+	if(emu->master == -1) {
+		perror_exit("posix_openpt");
+	}
+	if(grantpt(emu->master) == -1 || unlockpt(emu->master) == -1) {
+		perror_exit("grantpt/unlockpt");
+	}
+	/* Keep the slave open so the pty survives the tool closing it between
+	 * runs, and put it in raw mode for the benefit of anything other than
+	 * sump-dump talking to it */
+	emu->slave = open(ptsname(emu->master), O_RDWR | O_NOCTTY);
+	if(emu->slave == -1) {
+		perror_exit("open pty slave");
+	}
+	struct termios tios;
+	if(tcgetattr(emu->slave, &tios) == -1) {
+		perror_exit("tcgetattr");
+	}
+	cfmakeraw(&tios);
+	cfsetspeed(&tios, B115200);
+	if(tcsetattr(emu->slave, TCSANOW, &tios) == -1) {
+		perror_exit("tcsetattr");
+	}
+	int fl = fcntl(emu->master, F_GETFL);
+	fcntl(emu->master, F_SETFL, fl | O_NONBLOCK);
+}
+
+/* Serve on a unix socket rather than a pty, for sump-dump's unix: transport */
+static void open_socket(struct emu* emu)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	if(strlen(emu->cfg->listen_path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "emu: socket path too long\n");
+		exit(EXIT_FAILURE);
+	}
+	strcpy(addr.sun_path, emu->cfg->listen_path);
+	unlink(addr.sun_path);
+
+	emu->listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(emu->listener == -1) {
+		perror_exit("socket");
+	}
+	if(bind(emu->listener, (struct sockaddr const*)&addr, sizeof(addr)) == -1) {
+		perror_exit("bind");
+	}
+	if(listen(emu->listener, 1) == -1) {
+		perror_exit("listen");
+	}
+	emu->master = -1;
+	emu->slave = -1;
+}
+
+/* Wait for a connection, giving up if the command under test exits first */
+static bool accept_conn(struct emu* emu)
+{
+	while(1) {
+		struct pollfd pfd = { .fd = emu->listener, .events = POLLIN };
+		int r = poll(&pfd, 1, 100);
+		if(r == -1 && errno != EINTR) {
+			perror_exit("poll");
+		}
+		if(r <= 0) {
+			if(child_exited(emu)) {
+				return false;
+			}
+			continue;
+		}
+		emu->master = accept(emu->listener, NULL, NULL);
+		if(emu->master == -1) {
+			if(errno == EINTR) {
+				continue;
+			}
+			perror_exit("accept");
+		}
+		int fl = fcntl(emu->master, F_GETFL);
+		fcntl(emu->master, F_SETFL, fl | O_NONBLOCK);
+		return true;
+	}
+}
+
+static void spawn(struct emu* emu, char** cmd, unsigned ncmd, char const* out)
+{
+	char path[128];
+	if(emu->listener != -1) {
+		snprintf(path, sizeof(path), "unix:%s", emu->cfg->listen_path);
+	}
+	else {
+		snprintf(path, sizeof(path), "%s", ptsname(emu->master));
+	}
+	char** argv = calloc(ncmd + 1, sizeof(char*));
+	for(unsigned i = 0; i < ncmd; i += 1) {
+		argv[i] = strcmp(cmd[i], "{}") == 0? path : cmd[i];
+	}
+
+	emu->child = fork();
+	if(emu->child == -1) {
+		perror_exit("fork");
+	}
+	if(emu->child == 0) {
+		int o = open(out, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if(o == -1) {
+			perror_exit(out);
+		}
+		dup2(o, STDOUT_FILENO);
+		if(!emu->cfg->verbose) {
+			int n = open("/dev/null", O_WRONLY);
+			dup2(n, STDERR_FILENO);
+		}
+		if(emu->listener != -1) {
+			close(emu->listener);
+		}
+		else {
+			close(emu->master);
+			close(emu->slave);
+		}
+		execvp(argv[0], argv);
+		perror_exit(argv[0]);
+	}
+	free(argv);
+}
+
+static void usage(char const* prog, char const* msg)
+{
+	if(msg) {
+		fprintf(stderr, "argument error: %s\n", msg);
+	}
+	fprintf(stderr, "Usage: %s [<options>] [-- <command> ...]\n\n", prog);
+	fprintf(stderr,
+		"Emulates a SUMP device on a pseudo-terminal. Without a command the pty path is\n"
+		"printed on stdout and the emulator runs until killed. With a command, '{}' in\n"
+		"its arguments is replaced by the pty path, the command is run with its stdout\n"
+		"sent to 'out' and timing of the run is reported.\n"
+		"Example: %s pattern random density 0.01 -- ./sump-dump {} vcd clk=0x1\n\n"
+		"pattern <counter|random|walk|const>: sample data to generate (default = random).\n"
+		"density <0..1>: probability of each sample changing for random pattern (default = 0.1).\n"
+		"seed <num>: random seed / constant value (default = 1).\n"
+		"rate <bytes/s|tty>: readout throughput, 'tty' follows the baud set on the pty\n"
+		"	(default = unlimited).\n"
+		"sample_memory <bytes>: reported in extended metadata (default = 65536).\n"
+		"num_probes <num>: number of probes (default = 32).\n"
+		"clk_freq <hz>: reported in extended metadata (default = 100000000).\n"
+		"out <file>: where to send the command's stdout (default = /dev/null).\n"
+		"	If this is a regular file its size and the rate it was written at are reported.\n"
+		"label <text>: name for the run in the report.\n"
+		"listen <path>: serve on a unix socket rather than a pty, '{}' becomes\n"
+		"	unix:<path> for sump-dump.\n"
+		"verbose: log commands received, and let the command's stderr through.\n",
+		prog);
+	exit(EXIT_FAILURE);
+}
+
+static uint32_t parse_u32(char const* prog, char const* arg, char const* msg)
+{
+	if(arg == NULL) {
+		usage(prog, msg);
+	}
+	char* end;
+	unsigned long long n = strtoull(arg, &end, 0);
+	if(end == arg || n > UINT32_MAX) {
+		usage(prog, msg);
+	}
+	switch(end[0]) {
+		case 'M': case 'm': n *= 1000000; end += 1; break;
+		case 'K': case 'k': n *= 1000; end += 1; break;
+		default: break;
+	}
+	if(end[0] != '\0' || n > UINT32_MAX) {
+		usage(prog, msg);
+	}
+	return (uint32_t)n;
+}
+
+int main(int argc, char** argv)
+{
+	struct emu_cfg cfg = {
+		.pattern = PATTERN_RANDOM,
+		.density = 0.1,
+		.seed = 1,
+		.rate = 0,
+		.sample_memory = 1u << 16,
+		.num_probes = 32,
+		.clk_freq_hz = 100000000,
+		.verbose = false,
+		.listen_path = NULL,
+	};
+	char const* out = "/dev/null";
+	char const* label = NULL;
+
+	int pos = 1;
+	while(pos < argc) {
+		char const* opt = argv[pos++];
+		char const* arg = pos < argc? argv[pos] : NULL;
+		if(strcmp(opt, "--") == 0) {
+			break;
+		}
+		else if(strcmp(opt, "pattern") == 0) {
+			pos += 1;
+			if(arg == NULL) usage(argv[0], "Missing pattern");
+			else if(strcmp(arg, "counter") == 0) cfg.pattern = PATTERN_COUNTER;
+			else if(strcmp(arg, "random") == 0) cfg.pattern = PATTERN_RANDOM;
+			else if(strcmp(arg, "walk") == 0) cfg.pattern = PATTERN_WALK;
+			else if(strcmp(arg, "const") == 0) cfg.pattern = PATTERN_CONST;
+			else usage(argv[0], "Unknown pattern");
+		}
+		else if(strcmp(opt, "density") == 0) {
+			pos += 1;
+			char* end;
+			cfg.density = arg? strtod(arg, &end) : -1.0;
+			if(arg == NULL || end == arg || cfg.density < 0.0 || cfg.density > 1.0) {
+				usage(argv[0], "Invalid density");
+			}
+		}
+		else if(strcmp(opt, "seed") == 0) {
+			pos += 1;
+			cfg.seed = parse_u32(argv[0], arg, "Invalid seed");
+		}
+		else if(strcmp(opt, "rate") == 0) {
+			pos += 1;
+			if(arg && strcmp(arg, "tty") == 0) {
+				cfg.rate = UINT32_MAX;
+			}
+			else {
+				cfg.rate = parse_u32(argv[0], arg, "Invalid rate");
+			}
+		}
+		else if(strcmp(opt, "sample_memory") == 0) {
+			pos += 1;
+			cfg.sample_memory = parse_u32(argv[0], arg, "Invalid sample memory");
+		}
+		else if(strcmp(opt, "num_probes") == 0) {
+			pos += 1;
+			cfg.num_probes = parse_u32(argv[0], arg, "Invalid probe count");
+			if(cfg.num_probes == 0 || cfg.num_probes > 32) {
+				usage(argv[0], "Invalid probe count");
+			}
+		}
+		else if(strcmp(opt, "clk_freq") == 0) {
+			pos += 1;
+			cfg.clk_freq_hz = parse_u32(argv[0], arg, "Invalid clock frequency");
+		}
+		else if(strcmp(opt, "out") == 0) {
+			pos += 1;
+			if(arg == NULL) usage(argv[0], "Missing output file");
+			out = arg;
+		}
+		else if(strcmp(opt, "label") == 0) {
+			pos += 1;
+			if(arg == NULL) usage(argv[0], "Missing label");
+			label = arg;
+		}
+		else if(strcmp(opt, "verbose") == 0) {
+			cfg.verbose = true;
+		}
+		else if(strcmp(opt, "listen") == 0) {
+			pos += 1;
+			if(arg == NULL) usage(argv[0], "Missing socket path");
+			cfg.listen_path = arg;
+		}
+		else {
+			usage(argv[0], "Unknown argument");
+		}
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+
+	struct emu emu = { .cfg = &cfg, .child = 0, .listener = -1 };
+	if(cfg.listen_path) {
+		open_socket(&emu);
+	}
+	else {
+		open_pty(&emu);
+	}
+
+	if(pos >= argc) {
+		if(cfg.listen_path) {
+			printf("unix:%s\n", cfg.listen_path);
+			fflush(stdout);
+			/* One client at a time, until killed */
+			while(accept_conn(&emu)) {
+				emulate(&emu);
+				close(emu.master);
+			}
+			return EXIT_SUCCESS;
+		}
+		printf("%s\n", ptsname(emu.master));
+		fflush(stdout);
+		emulate(&emu);
+		return EXIT_SUCCESS;
+	}
+
+	struct sigaction sa = { .sa_handler = sigchld };
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGCHLD, &sa, NULL);
+
+	double const t_start = now();
+	spawn(&emu, &argv[pos], argc - pos, out);
+	if(emu.listener == -1 || accept_conn(&emu)) {
+		emulate(&emu);
+	}
+	if(emu.listener != -1) {
+		/* Wait for the command to finish, as with a pty */
+		while(!child_exited(&emu)) {
+			poll(NULL, 0, 10);
+		}
+		unlink(cfg.listen_path);
+	}
+	double const t_exit = emu.t_exit;
+	int const status = emu.child_status;
+
+	if(emu.captures == 0) {
+		fprintf(stderr, "emu: command exited without completing a capture\n");
+		return EXIT_FAILURE;
+	}
+
+	double const readout = emu.t_last - emu.t_run;
+	double const format = t_exit - emu.t_last;
+	printf("%-24s wall %8.3f s  readout %8.3f s  %10.0f B/s  backend %8.1f ns/sample (%llu samples)\n",
+		label? label : argv[pos],
+		t_exit - t_start, readout,
+		readout > 0? (double)emu.bytes_sent / readout : 0.0,
+		format * 1e9 / (double)emu.samples_sent,
+		(unsigned long long)emu.samples_sent);
+
+	/* Output throughput, if it went somewhere it can be measured */
+	struct stat st;
+	if(stat(out, &st) == 0 && S_ISREG(st.st_mode) && t_exit > emu.t_run) {
+		printf("%-24s output %10lld bytes  %8.1f bytes/sample  %8.1f MB/s from run to exit\n",
+			"", (long long)st.st_size, (double)st.st_size / (double)emu.samples_sent,
+			(double)st.st_size / (t_exit - emu.t_run) * 1e-6);
+	}
+
+	return WIFEXITED(status)? WEXITSTATUS(status) : EXIT_FAILURE;
+}
@@ -0,0 +1,64 @@
+import collections
+import struct
+
+# Reader for the compressed sample files written by sump-dump's 'compress'
+# option, see the comment above struct sumpz_header in sump-dump.c
+
+Header = collections.namedtuple('Header', 'version header_bytes flags num_samples chunk_samples '
+    'bytes_per_sample trigger_sample requested_samples group_enable num_probes clk_freq_hz clk_divisor')
+
+HEADER_FORMAT = '=8s12I'
+BITPLANES = 0x1
+TRUNCATED = 0x2
+
+def varints(data, pos):
+    while True:
+        v = 0
+        shift = 0
+        while True:
+            b = data[pos]
+            pos += 1
+            v |= (b & 0x7F) << shift
+            shift += 7
+            if not b & 0x80:
+                break
+        yield v
+
+def decode(data):
+    """Returns the header and a list of the samples (as ints, oldest first)"""
+    fields = struct.unpack_from(HEADER_FORMAT, data)
+    assert fields[0].rstrip(b'\0') == b'SUMPZ', 'not a compressed sample file'
+    hdr = Header(*fields[1:])
+    assert hdr.version == 1, 'unsupported version %d' % hdr.version
+
+    nums = varints(data, hdr.header_bytes)
+    samples = []
+    value = 0
+    n = hdr.num_samples % hdr.chunk_samples or hdr.chunk_samples
+    while len(samples) < hdr.num_samples:
+        toggled = [0] * n
+        if hdr.flags & BITPLANES:
+            for bit in range(hdr.bytes_per_sample * 8):
+                at = 0
+                for _ in range(next(nums)):
+                    at += next(nums)
+                    toggled[at] |= 1 << bit
+        else:
+            at = 0
+            for _ in range(next(nums)):
+                at += next(nums)
+                toggled[at] |= next(nums)
+        for t in toggled:
+            value ^= t
+            samples.append(value)
+        n = hdr.chunk_samples
+    return hdr, samples
+
+if __name__ == '__main__':
+    # Convert to raw, as written by sump-dump's 'raw' option
+    import sys
+    hdr, samples = decode(sys.stdin.buffer.read())
+    out = bytearray()
+    for s in samples:
+        out += s.to_bytes(hdr.bytes_per_sample, 'little')
+    sys.stdout.buffer.write(out)